@@ -0,0 +1,1041 @@
+// Benchmarks of the force solvers, the update phases and the renderers over a
+// range of body counts. Prints a table and optionally writes the results as
+// JSON so runs can be compared over time. --pareto instead weighs the force
+// error of every solver setting against its speed, --scaling how the
+// threaded solver scales from 1 thread to all of them, and --regression checks
+// every solver setting against a golden trajectory.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "image.hpp"
+#include "initial_conditions.hpp"
+#include "parallel.hpp"
+#include "physics.hpp"
+#include "random.hpp"
+#include "render.hpp"
+#include "shared_memory.hpp"
+#include "trajectory.hpp"
+
+struct BenchOptions {
+  std::vector<size_t> sizes = {256, 1024, 4096, 16384, 65536, 262144, 1000000};
+  uint repetitions = 5;
+  uint warmup = 1;
+  // A case is skipped at sizes where it is expected to take longer than this
+  // for all its runs.
+  double max_seconds = 20;
+  uint threads = 0;
+  std::string only; // run only cases whose name starts with this
+  std::string json_path;
+  std::string pareto_path; // accuracy against speed as CSV instead
+  std::string scaling_path; // strong and weak scaling as CSV instead
+  std::string regression_path; // golden trajectory to check against instead
+  std::string golden_path; // golden trajectory to record instead
+  bool pin_threads = false;
+};
+
+inline const char *bench_usage() {
+  return "usage: nbody_bench [options]\n"
+         "  --sizes N,N,...               body counts (default "
+         "256,1024,...,1000000)\n"
+         "  --repetitions R               timed runs per case (default 5)\n"
+         "  --warmup W                    untimed runs first (default 1)\n"
+         "  --max-seconds S               skip sizes a case won't finish in "
+         "(default 20)\n"
+         "  --threads N                   worker threads, 0 for all (default "
+         "0)\n"
+         "  --only NAME                   only cases starting with NAME, e.g. "
+         "force/\n"
+         "  --json PATH                   also write the results as JSON, - for "
+         "stdout\n"
+         "  --pareto PATH                 sweep solver settings for force "
+         "error and\n"
+         "                                speed instead, CSV to PATH or -\n"
+         "  --scaling PATH                strong and weak scaling over 1 to "
+         "--threads\n"
+         "                                threads instead, CSV to PATH or -\n"
+         "  --regression PATH             check every solver setting against "
+         "the\n"
+         "                                golden trajectory at PATH\n"
+         "  --record-golden PATH          record the golden trajectory to PATH "
+         "with\n"
+         "                                the pairwise solver\n"
+         "  --pin on|off                  pin worker threads to CPUs (default "
+         "off)\n";
+}
+
+inline BenchOptions parse_bench_options(int argc, char **argv) {
+  BenchOptions options;
+  for (int i = 1; i < argc; i++) {
+    const std::string_view option = argv[i];
+    // every option takes exactly one value
+    if (i + 1 >= argc)
+      throw std::invalid_argument(std::string(option) + " needs a value");
+    const std::string value = argv[++i];
+
+    if (option == "--sizes") {
+      options.sizes.clear();
+      for (size_t start = 0; start <= value.size();) {
+        const size_t comma = std::min(value.find(',', start), value.size());
+        options.sizes.push_back(std::stoull(value.substr(start, comma - start)));
+        if (options.sizes.back() < 2)
+          throw std::invalid_argument("need at least 2 bodies");
+        start = comma + 1;
+      }
+    } else if (option == "--repetitions") {
+      options.repetitions = std::stoul(value);
+      if (options.repetitions == 0)
+        throw std::invalid_argument("need at least 1 repetition");
+    } else if (option == "--warmup") {
+      options.warmup = std::stoul(value);
+    } else if (option == "--max-seconds") {
+      options.max_seconds = std::stod(value);
+    } else if (option == "--threads") {
+      options.threads = std::stoul(value);
+    } else if (option == "--only") {
+      options.only = value;
+    } else if (option == "--json") {
+      options.json_path = value;
+    } else if (option == "--pareto") {
+      options.pareto_path = value;
+    } else if (option == "--scaling") {
+      options.scaling_path = value;
+    } else if (option == "--regression") {
+      options.regression_path = value;
+    } else if (option == "--record-golden") {
+      options.golden_path = value;
+    } else if (option == "--pin") {
+      if (value != "on" && value != "off")
+        throw std::invalid_argument("--pin takes on or off");
+      options.pin_threads = value == "on";
+    } else {
+      throw std::invalid_argument("unknown option " + std::string(option));
+    }
+  }
+  return options;
+}
+
+// Timings of one case at one size.
+struct BenchResult {
+  std::string name;
+  size_t n = 0;
+  double interactions = 0; // pair interactions per run, 0 if not a force
+  std::vector<double> seconds; // sorted
+
+  // Linear interpolation between the closest ranks, p from 0 to 100.
+  double percentile(double p) const {
+    const double rank = p / 100 * (seconds.size() - 1);
+    const size_t low = (size_t)rank;
+    const size_t high = std::min(low + 1, seconds.size() - 1);
+    return seconds[low] + (seconds[high] - seconds[low]) * (rank - low);
+  }
+  double median() const { return percentile(50); }
+  double interactions_per_second() const { return interactions / median(); }
+  double gflops() const {
+    return interactions * flops_per_interaction / median() / 1e9;
+  }
+  double nanoseconds_per_body_step() const { return median() / n * 1e9; }
+};
+
+// A benchmark case: prepare(bodies) runs before every run untimed, run(bodies)
+// is timed. cost(n) is the relative cost at n bodies, used to skip sizes that
+// would take too long.
+struct BenchCase {
+  std::string name;
+  std::function<void(Bodies &)> prepare;
+  std::function<void(Bodies &)> run;
+  std::function<double(size_t)> interactions; // per run
+  std::function<double(size_t)> cost;
+};
+
+inline BenchResult measure(const BenchCase &bench_case, const Bodies &initial,
+                           const BenchOptions &options) {
+  BenchResult result;
+  result.name = bench_case.name;
+  result.n = initial.size();
+  result.interactions =
+      bench_case.interactions ? bench_case.interactions(initial.size()) : 0;
+
+  Bodies bodies;
+  for (uint run = 0; run < options.warmup + options.repetitions; run++) {
+    bodies = initial;
+    if (bench_case.prepare)
+      bench_case.prepare(bodies);
+    const auto start = std::chrono::steady_clock::now();
+    bench_case.run(bodies);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (run >= options.warmup)
+      result.seconds.push_back(elapsed.count());
+  }
+  std::sort(result.seconds.begin(), result.seconds.end());
+  return result;
+}
+
+inline std::vector<BenchCase> bench_cases() {
+  const auto quadratic = [](size_t n) { return (double)n * n; };
+  const auto linear = [](size_t n) { return (double)n; };
+  const double G = 1;
+  std::vector<BenchCase> cases;
+
+  cases.push_back({"force/pairwise",
+                   nullptr,
+                   [G](Bodies &bodies) { accelerate_pairwise(bodies, G); },
+                   [](size_t n) {
+                     return interactions_per_update(n, Solver::pairwise);
+                   },
+                   quadratic});
+  cases.push_back({"force/parallel",
+                   nullptr,
+                   [G](Bodies &bodies) { accelerate_parallel(bodies, G); },
+                   [](size_t n) {
+                     return interactions_per_update(n, Solver::parallel);
+                   },
+                   quadratic});
+
+  // the same with the potential energy added up, as on diagnostics updates
+  cases.push_back({"force/pairwise_potential",
+                   nullptr,
+                   [G](Bodies &bodies) { accelerate_pairwise<true>(bodies, G); },
+                   [](size_t n) {
+                     return interactions_per_update(n, Solver::pairwise);
+                   },
+                   quadratic});
+  cases.push_back({"force/parallel_potential",
+                   nullptr,
+                   [G](Bodies &bodies) { accelerate_parallel<true>(bodies, G); },
+                   [](size_t n) {
+                     return interactions_per_update(n, Solver::parallel);
+                   },
+                   quadratic});
+
+  cases.push_back(
+      {"phase/drift", nullptr, [](Bodies &bodies) { drift(bodies); }, nullptr,
+       linear});
+  cases.push_back({"phase/bounds", nullptr,
+                   [](Bodies &bodies) {
+                     volatile double center = compute_bounds(bodies).center_x();
+                     (void)center;
+                   },
+                   nullptr, linear});
+  cases.push_back({"phase/recentre", nullptr,
+                   [](Bodies &bodies) {
+                     Bounds bounds = compute_bounds(bodies);
+                     recentre(bodies, bounds);
+                   },
+                   nullptr, linear});
+
+  // A whole update as the simulation does it, with the threaded solver.
+  cases.push_back({"integrator/drift_kick",
+                   nullptr,
+                   [G](Bodies &bodies) {
+                     drift(bodies);
+                     Bounds bounds = compute_bounds(bodies);
+                     accelerate_parallel(bodies, G);
+                     recentre(bodies, bounds);
+                   },
+                   [](size_t n) {
+                     return interactions_per_update(n, Solver::parallel);
+                   },
+                   quadratic});
+
+  cases.push_back({"render/map", nullptr,
+                   [](Bodies &bodies) {
+                     const std::string map =
+                         create_map_of_bodies(50, 200, bodies,
+                                              compute_bounds(bodies));
+                     volatile size_t size = map.size();
+                     (void)size;
+                   },
+                   nullptr, linear});
+  cases.push_back({"render/density", nullptr,
+                   [](Bodies &bodies) {
+                     const std::string map = create_density_map_of_bodies(
+                         50, 200, bodies, compute_bounds(bodies),
+                         DensityWeight::count, true);
+                     volatile size_t size = map.size();
+                     (void)size;
+                   },
+                   nullptr, linear});
+  cases.push_back({"render/image", nullptr,
+                   [](Bodies &bodies) {
+                     const Image image =
+                         tone_map(1280, 720,
+                                  splat_bodies(1280, 720, bodies,
+                                               compute_bounds(bodies),
+                                               Camera{}, DensityWeight::count));
+                     volatile size_t size = image.pixels.size();
+                     (void)size;
+                   },
+                   nullptr, linear});
+  return cases;
+}
+
+inline std::string results_json(const std::vector<BenchResult> &results,
+                                const BenchOptions &options) {
+  std::string json = "{\n";
+  json += std::format("  \"timestamp\": {},\n", (long long)std::time(nullptr));
+  json += std::format("  \"threads\": {},\n", thread_count());
+  json += std::format("  \"repetitions\": {},\n", options.repetitions);
+  json += std::format("  \"warmup\": {},\n", options.warmup);
+#if defined(__VERSION__)
+  json += std::format("  \"compiler\": \"{}\",\n", __VERSION__);
+#endif
+  json += "  \"results\": [";
+  for (size_t r = 0; r < results.size(); r++) {
+    const BenchResult &result = results[r];
+    json += r == 0 ? "\n" : ",\n";
+    json += std::format(
+        "    {{\"name\": \"{}\", \"n\": {}, \"median_s\": {:.9g}, "
+        "\"p10_s\": {:.9g}, \"p90_s\": {:.9g}, \"min_s\": {:.9g}, "
+        "\"max_s\": {:.9g}, \"ns_per_body_step\": {:.6g}",
+        result.name, result.n, result.median(), result.percentile(10),
+        result.percentile(90), result.seconds.front(), result.seconds.back(),
+        result.nanoseconds_per_body_step());
+    if (result.interactions > 0)
+      json += std::format(
+          ", \"interactions_per_s\": {:.6g}, \"gflops\": {:.6g}",
+          result.interactions_per_second(), result.gflops());
+    json += "}";
+  }
+  json += "\n  ]\n}\n";
+  return json;
+}
+
+// One setting of the force solver in the accuracy sweep.
+struct ForceSetting {
+  Solver solver;
+  Precision precision;
+  const char *solver_name;
+  const char *precision_name;
+};
+
+inline const std::vector<ForceSetting> &force_settings() {
+  static const std::vector<ForceSetting> settings = {
+      {Solver::pairwise, Precision::full, "pairwise", "double"},
+      {Solver::parallel, Precision::full, "parallel", "double"},
+      {Solver::parallel, Precision::mixed, "parallel", "mixed"},
+      {Solver::parallel, Precision::single, "parallel", "float"},
+  };
+  return settings;
+}
+
+// Accelerations of every body from the direct sum over all others in long
+// double, the reference the solvers are measured against.
+inline std::vector<std::array<long double, 3>>
+reference_accelerations(const Bodies &bodies, double gravitational_constant) {
+  const size_t n = bodies.size();
+  std::vector<std::array<long double, 3>> accelerations(n);
+  parallel_for(
+      n,
+      [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; i++) {
+          long double ax = 0, ay = 0, az = 0;
+          for (size_t j = 0; j < n; j++) {
+            if (j == i)
+              continue;
+            const long double dx = (long double)bodies.x[j] - bodies.x[i],
+                              dy = (long double)bodies.y[j] - bodies.y[i],
+                              dz = (long double)bodies.z[j] - bodies.z[i];
+            const long double scale = gravitational_constant * bodies.mass[j] /
+                                      (dx * dx + dy * dy + dz * dz);
+            ax += dx * scale;
+            ay += dy * scale;
+            az += dz * scale;
+          }
+          accelerations[i] = {ax, ay, az};
+        }
+      },
+      16);
+  return accelerations;
+}
+
+// A setting at one size: its speed and the error of its accelerations,
+// relative to the size of the reference acceleration of each body.
+struct ParetoPoint {
+  const ForceSetting *setting;
+  BenchResult timing;
+  double rms_error = 0, max_error = 0;
+  bool optimal = false; // nothing else is both faster and more accurate
+};
+
+inline ParetoPoint measure_force_setting(
+    const ForceSetting &setting, const Bodies &initial,
+    const std::vector<std::array<long double, 3>> &reference,
+    const BenchOptions &options) {
+  const double G = 1;
+  const auto zero_velocities = [](Bodies &bodies) {
+    std::fill(bodies.vx.begin(), bodies.vx.end(), 0.0);
+    std::fill(bodies.vy.begin(), bodies.vy.end(), 0.0);
+    std::fill(bodies.vz.begin(), bodies.vz.end(), 0.0);
+  };
+  const BenchCase bench_case = {
+      std::string("force/") + setting.solver_name + "/" +
+          setting.precision_name,
+      zero_velocities,
+      [&](Bodies &bodies) {
+        accelerate(bodies, G, setting.solver, setting.precision);
+      },
+      [&](size_t n) { return interactions_per_update(n, setting.solver); },
+      nullptr};
+
+  ParetoPoint point;
+  point.setting = &setting;
+  point.timing = measure(bench_case, initial, options);
+
+  // from rest, one update leaves the acceleration in the velocity
+  Bodies bodies = initial;
+  zero_velocities(bodies);
+  bench_case.run(bodies);
+  double sum = 0;
+  for (size_t i = 0; i < bodies.size(); i++) {
+    const std::array<long double, 3> &exact = reference[i];
+    const long double ex = bodies.vx[i] - exact[0],
+                      ey = bodies.vy[i] - exact[1],
+                      ez = bodies.vz[i] - exact[2];
+    const long double size =
+        exact[0] * exact[0] + exact[1] * exact[1] + exact[2] * exact[2];
+    const double error =
+        size > 0 ? (double)std::sqrt((ex * ex + ey * ey + ez * ez) / size) : 0;
+    sum += error * error;
+    point.max_error = std::max(point.max_error, error);
+  }
+  point.rms_error = std::sqrt(sum / bodies.size());
+  return point;
+}
+
+// Every force setting on a Plummer sphere at every size, the reference
+// included in the time limit. Marks the settings no other beats on both
+// speed and error at the same size, and writes them all as CSV.
+inline int pareto_sweep(const BenchOptions &options) {
+  std::vector<size_t> sizes = options.sizes;
+  std::sort(sizes.begin(), sizes.end());
+  std::cout << std::format("{} threads, force error against a long double "
+                           "direct sum, Plummer sphere\n\n",
+                           thread_count());
+  std::cout << std::format("{:<18}{:>9}{:>13}{:>14}{:>13}{:>13}{:>9}\n",
+                           "setting", "n", "median ms", "pairs/s", "rms error",
+                           "max error", "pareto");
+
+  std::string csv = "n,solver,precision,median_s,interactions_per_s,"
+                    "rms_force_error,max_force_error,pareto\n";
+  double seconds_per_pair = 0;
+  for (size_t n : sizes) {
+    // the reference and every setting once per run, roughly
+    const double expected = seconds_per_pair * (double)n * n *
+                            (1 + force_settings().size() *
+                                     (options.warmup + options.repetitions));
+    if (expected > options.max_seconds) {
+      std::cout << std::format("{:<18}{:>9}  skipped, about {:.0f} s\n",
+                               "all", n, expected);
+      continue;
+    }
+
+    Bodies bodies;
+    InitialConditions plummer;
+    plummer.model = Model::plummer;
+    generate_model(bodies, n, 1, plummer);
+    const auto start = std::chrono::steady_clock::now();
+    const auto reference = reference_accelerations(bodies, 1);
+    const std::chrono::duration<double> reference_time =
+        std::chrono::steady_clock::now() - start;
+    seconds_per_pair = reference_time.count() / ((double)n * n);
+
+    std::vector<ParetoPoint> points;
+    for (const ForceSetting &setting : force_settings())
+      points.push_back(measure_force_setting(setting, bodies, reference,
+                                             options));
+    for (ParetoPoint &point : points) {
+      point.optimal = std::none_of(
+          points.begin(), points.end(), [&](const ParetoPoint &other) {
+            const double time = other.timing.median(),
+                         own_time = point.timing.median();
+            return time <= own_time && other.rms_error <= point.rms_error &&
+                   (time < own_time || other.rms_error < point.rms_error);
+          });
+    }
+
+    for (const ParetoPoint &point : points) {
+      const std::string setting = std::string(point.setting->solver_name) +
+                                  "/" + point.setting->precision_name;
+      std::cout << std::format(
+          "{:<18}{:>9}{:>13.3f}{:>14.4g}{:>13.3e}{:>13.3e}{:>9}\n", setting,
+          n, point.timing.median() * 1e3,
+          point.timing.interactions_per_second(), point.rms_error,
+          point.max_error, point.optimal ? "yes" : "");
+      csv += std::format("{},{},{},{:.9g},{:.6g},{:.6e},{:.6e},{}\n", n,
+                         point.setting->solver_name,
+                         point.setting->precision_name, point.timing.median(),
+                         point.timing.interactions_per_second(),
+                         point.rms_error, point.max_error,
+                         point.optimal ? 1 : 0);
+    }
+  }
+
+  if (options.pareto_path == "-") {
+    std::cout << '\n' << csv;
+  } else {
+    std::ofstream file(options.pareto_path);
+    file << csv;
+    if (!file) {
+      std::cerr << "can't write " << options.pareto_path << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The thread counts a scaling sweep runs: powers of 2 up to the most, and the
+// most itself.
+inline std::vector<unsigned> scaling_thread_counts(unsigned most) {
+  std::vector<unsigned> counts;
+  for (unsigned threads = 1; threads < most; threads *= 2)
+    counts.push_back(threads);
+  counts.push_back(most);
+  return counts;
+}
+
+// One run of a scaling sweep.
+struct ScalingPoint {
+  const char *mode; // strong or weak
+  const ForceSetting *setting;
+  unsigned threads;
+  BenchResult timing;
+  // Strong: time on 1 thread over time on these. Weak: pairs per second over
+  // that on 1 thread, the scaled speedup.
+  double speedup = 0;
+  double efficiency = 0; // speedup per thread
+  // The Karp-Flatt metric, the serial fraction that explains the speedup
+  // under Amdahl's law. Strong scaling only.
+  double serial_fraction = NAN;
+};
+
+// The parallel solver in every precision on Plummer spheres, at 1 to
+// thread_count() threads. Strong scaling keeps each size for every thread
+// count. Weak scaling starts from each size on 1 thread and grows it with
+// the square root of the threads, so every thread gets the same number of
+// pairs of the O(n^2) force loop.
+inline int scaling_sweep(const BenchOptions &options) {
+  std::vector<size_t> sizes = options.sizes;
+  std::sort(sizes.begin(), sizes.end());
+  const unsigned most = thread_count();
+  const std::vector<unsigned> counts = scaling_thread_counts(most);
+  std::cout << std::format("1 to {} threads of {} CPUs, threads {}, Plummer "
+                           "sphere\n\n",
+                           most, allowed_cpus().size(),
+                           options.pin_threads ? "pinned" : "not pinned");
+  std::cout << std::format("{:<8}{:<17}{:>9}{:>9}{:>13}{:>14}{:>10}{:>12}"
+                           "{:>10}\n",
+                           "mode", "setting", "threads", "n", "median ms",
+                           "pairs/s", "speedup", "efficiency", "serial");
+
+  std::string csv = "mode,solver,precision,threads,n,median_s,"
+                    "interactions_per_s,speedup,efficiency,serial_fraction\n";
+  const auto report = [&](const ScalingPoint &point) {
+    const std::string setting = std::string(point.setting->solver_name) + "/" +
+                                point.setting->precision_name;
+    const std::string serial =
+        std::isnan(point.serial_fraction)
+            ? ""
+            : std::format("{:.4f}", point.serial_fraction);
+    std::cout << std::format(
+        "{:<8}{:<17}{:>9}{:>9}{:>13.3f}{:>14.4g}{:>10.2f}{:>12.3f}{:>10}\n",
+        point.mode, setting, point.threads, point.timing.n,
+        point.timing.median() * 1e3, point.timing.interactions_per_second(),
+        point.speedup, point.efficiency, serial);
+    csv += std::format("{},{},{},{},{},{:.9g},{:.6g},{:.6g},{:.6g},{}\n",
+                       point.mode, point.setting->solver_name,
+                       point.setting->precision_name, point.threads,
+                       point.timing.n, point.timing.median(),
+                       point.timing.interactions_per_second(), point.speedup,
+                       point.efficiency, serial);
+  };
+
+  const double G = 1;
+  for (const ForceSetting &setting : force_settings()) {
+    const std::string name = std::string("force/") + setting.solver_name +
+                             "/" + setting.precision_name;
+    if (setting.solver != Solver::parallel || !name.starts_with(options.only))
+      continue;
+    const BenchCase bench_case = {
+        name, nullptr,
+        [&](Bodies &bodies) {
+          accelerate(bodies, G, setting.solver, setting.precision);
+        },
+        [&](size_t n) { return interactions_per_update(n, setting.solver); },
+        nullptr};
+    const auto run = [&](size_t n, unsigned threads) {
+      Bodies bodies;
+      InitialConditions plummer;
+      plummer.model = Model::plummer;
+      generate_model(bodies, n, 1, plummer);
+      set_thread_count(threads);
+      return measure(bench_case, bodies, options);
+    };
+
+    double seconds_per_pair = 0; // on 1 thread, to skip sizes
+    for (size_t n : sizes) {
+      // a strong sweep takes about twice the 1 thread runs, and so does a
+      // weak one if it scales
+      const double expected = seconds_per_pair * (double)n * n *
+                              (options.warmup + options.repetitions) * 4;
+      if (expected > options.max_seconds) {
+        std::cout << std::format("{:<8}{:<17}{:>9}{:>9}  skipped, about "
+                                 "{:.0f} s\n",
+                                 "all", name.substr(6), "", n, expected);
+        continue;
+      }
+
+      const BenchResult single = run(n, 1);
+      seconds_per_pair = single.median() / ((double)n * n);
+      for (unsigned threads : counts) {
+        ScalingPoint point = {"strong", &setting, threads,
+                              threads == 1 ? single : run(n, threads)};
+        point.speedup = single.median() / point.timing.median();
+        point.efficiency = point.speedup / threads;
+        if (threads > 1)
+          point.serial_fraction =
+              (1 / point.speedup - 1.0 / threads) / (1 - 1.0 / threads);
+        report(point);
+      }
+      for (unsigned threads : counts) {
+        const size_t grown = (size_t)std::llround(n * std::sqrt(threads));
+        ScalingPoint point = {"weak", &setting, threads,
+                              threads == 1 ? single : run(grown, threads)};
+        point.speedup = point.timing.interactions_per_second() /
+                        single.interactions_per_second();
+        point.efficiency = point.speedup / threads;
+        report(point);
+      }
+    }
+  }
+  if (options.scaling_path == "-") {
+    std::cout << '\n' << csv;
+  } else {
+    std::ofstream file(options.scaling_path);
+    file << csv;
+    if (!file) {
+      std::cerr << "can't write " << options.scaling_path << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The system of the regression check: a small Plummer sphere from a fixed
+// seed, run for few enough updates that rounding differences between the
+// solvers don't grow out of their tolerances, and fast enough to run on
+// every build. Every regression_stride-th update is compared, which keeps
+// the golden trajectory small.
+inline constexpr size_t regression_bodies = 256;
+inline constexpr uint64_t regression_seed = 20240601;
+inline constexpr uint regression_updates = 40;
+inline constexpr uint regression_stride = 5;
+inline constexpr double regression_gravitational_constant = 1;
+
+// An update as the simulation does it: drift, bounds, force, recentre.
+inline void regression_update(Bodies &bodies, const ForceSetting &setting) {
+  drift(bodies);
+  Bounds bounds = compute_bounds(bodies);
+  accelerate(bodies, regression_gravitational_constant, setting.solver,
+             setting.precision);
+  recentre(bodies, bounds);
+}
+
+// Largest distance between the same body in two runs over all steps,
+// relative to the RMS radius of the first step of the golden run, and
+// whether every value of every step is the same to the bit.
+struct TrajectoryDifference {
+  double error = 0;
+  bool bitwise = true;
+};
+
+inline TrajectoryDifference
+compare_trajectories(const std::vector<Bodies> &run,
+                     const std::vector<Bodies> &golden) {
+  double radius_squared = 0;
+  for (size_t i = 0; i < golden[0].size(); i++)
+    radius_squared += golden[0].x[i] * golden[0].x[i] +
+                      golden[0].y[i] * golden[0].y[i] +
+                      golden[0].z[i] * golden[0].z[i];
+  const double radius = std::sqrt(radius_squared / golden[0].size());
+
+  TrajectoryDifference difference;
+  for (size_t step = 0; step < golden.size(); step++) {
+    const Bodies &a = run[step], &b = golden[step];
+    for (size_t i = 0; i < b.size(); i++) {
+      const double dx = a.x[i] - b.x[i], dy = a.y[i] - b.y[i],
+                   dz = a.z[i] - b.z[i];
+      difference.error = std::max(
+          difference.error, std::sqrt(dx * dx + dy * dy + dz * dz) / radius);
+    }
+    const std::array<const Column *, 6> columns_a = {&a.x,  &a.y,  &a.z,
+                                                     &a.vx, &a.vy, &a.vz};
+    const std::array<const Column *, 6> columns_b = {&b.x,  &b.y,  &b.z,
+                                                     &b.vx, &b.vy, &b.vz};
+    for (size_t c = 0; c < columns_a.size(); c++)
+      difference.bitwise =
+          difference.bitwise &&
+          std::memcmp(columns_a[c]->data(), columns_b[c]->data(),
+                      b.size() * sizeof(double)) == 0;
+  }
+  return difference;
+}
+
+// Every regression_stride-th step of the regression system with one
+// setting, the first step being the initial conditions.
+inline std::vector<Bodies> regression_run(const ForceSetting &setting,
+                                          unsigned threads) {
+  set_thread_count(threads);
+  Bodies bodies;
+  InitialConditions plummer;
+  plummer.model = Model::plummer;
+  generate_model(bodies, regression_bodies, regression_seed, plummer);
+  std::vector<Bodies> steps = {bodies};
+  for (uint update = 0; update < regression_updates; update++) {
+    regression_update(bodies, setting);
+    if ((update + 1) % regression_stride == 0)
+      steps.push_back(bodies);
+  }
+  return steps;
+}
+
+// How far each setting may end up from the golden run, which is pairwise in
+// double: the parallel solver adds the pairs up in another order, and float
+// rounds every pair term. Some 20 times what they differ by for float and
+// 1000 for double, room for another compiler or FMA contraction but not for
+// a pair term that is off.
+inline double regression_tolerance(const ForceSetting &setting) {
+  switch (setting.precision) {
+  case Precision::single:
+    return 3e-8;
+  case Precision::mixed:
+    return 1e-8;
+  default:
+    return 1e-12;
+  }
+}
+
+// Whether philox4x32 gives the known answers of Random123's kat_vectors,
+// without which the initial conditions of a seed would change.
+inline bool check_philox() {
+  struct Vector {
+    std::array<uint32_t, 4> counter;
+    std::array<uint32_t, 2> key;
+    std::array<uint32_t, 4> expected;
+  };
+  const std::array<Vector, 3> vectors = {{
+      {{0, 0, 0, 0}, {0, 0}, {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+      {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+       {0xffffffff, 0xffffffff},
+       {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+      {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+       {0xa4093822, 0x299f31d0},
+       {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+  }};
+  return std::all_of(vectors.begin(), vectors.end(), [](const Vector &v) {
+    return philox4x32(v.counter, v.key) == v.expected;
+  });
+}
+
+// Whether a reader of nbody_shm.h gets a whole published snapshot, and keeps
+// reading its region without faulting when a publisher of another size
+// takes the name over.
+inline bool check_shared_memory() {
+#if defined(_WIN32)
+  return true;
+#else
+  const std::string name = std::format("/nbody_regression_{}", getpid());
+  const auto bodies_of = [](size_t n, double value) {
+    Bodies bodies;
+    bodies.resize(n);
+    std::fill(bodies.x.begin(), bodies.x.end(), value);
+    std::fill(bodies.mass.begin(), bodies.mass.end(), 1.0);
+    return bodies;
+  };
+  SimulationState state;
+  state.update_count = 7;
+  auto first = std::make_unique<SnapshotPublisher>(name, 16, 2, 1.0);
+  first->publish(bodies_of(16, 1.0), state);
+
+  nbody_shm_reader reader;
+  if (nbody_shm_open(&reader, name.c_str()) != 0)
+    return false;
+  std::vector<double> x(16), mass(16);
+  double *columns[NBODY_SHM_COLUMNS] = {x.data(), 0, 0, 0, 0, 0, mass.data()};
+  uint64_t step = 0;
+  bool ok = nbody_shm_read_latest(&reader, columns, &step) == 0 &&
+            step == 7 && x[15] == 1.0 && mass[15] == 1.0;
+
+  // a new run with more bodies and slots under the same name
+  SnapshotPublisher second(name, 64, 4, 1.0);
+  second.publish(bodies_of(64, 2.0), state);
+  ok = ok && nbody_shm_read_latest(&reader, columns, &step) == 0 &&
+       x[15] == 1.0;
+  nbody_shm_close(&reader);
+  if (nbody_shm_open(&reader, name.c_str()) != 0)
+    return false;
+  ok = ok && reader.header->number_of_bodies == 64;
+  nbody_shm_close(&reader);
+  first.reset(); // unlinks the name, which is the second's region by now
+  return ok;
+#endif
+}
+
+// Whether a trajectory missing a chunk, as left when one can't be
+// compressed or written, still reads every step that is there with its own
+// step number. Cuts the middle chunk out of a small trajectory to make one.
+inline bool check_trajectory_gap() {
+  const std::filesystem::path directory =
+      std::filesystem::temp_directory_path();
+  const std::string whole = (directory / "nbody_whole.traj").string(),
+                    gapped = (directory / "nbody_gapped.traj").string();
+  Bodies bodies;
+  generate_uniform_cube(bodies, 16, regression_seed);
+  {
+    // 3 chunks of 2 steps, every step told apart by its first position
+    TrajectoryWriter writer(whole, bodies, SimulationState{},
+                            Codec::run_length, 2);
+    for (uint64_t step = 0; step < 6; step++) {
+      bodies.x[0] = (double)step;
+      writer.append(bodies, step);
+    }
+  }
+
+  std::string data;
+  {
+    std::ifstream file(whole, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), {});
+  }
+  std::vector<TrajectoryIndexEntry> index =
+      TrajectoryReader(whole).chunks();
+  TrajectoryFooter footer;
+  std::memcpy(&footer, data.data() + data.size() - sizeof(footer),
+              sizeof(footer));
+  const size_t cut_begin = index[1].offset, cut_end = index[2].offset;
+  std::string cut = data.substr(0, cut_begin) +
+                    data.substr(cut_end, footer.index_offset - cut_end);
+  index.erase(index.begin() + 1);
+  index[1].offset -= cut_end - cut_begin;
+  footer.index_offset = cut.size();
+  footer.chunk_count = index.size();
+  cut.append((const char *)index.data(),
+             index.size() * sizeof(TrajectoryIndexEntry));
+  cut.append((const char *)&footer, sizeof(footer));
+  std::ofstream(gapped, std::ios::binary) << cut;
+
+  bool ok;
+  {
+    TrajectoryReader reader(gapped);
+    const std::array<uint64_t, 4> stored = {0, 1, 4, 5};
+    ok = reader.steps() == stored.size();
+    Bodies read;
+    for (size_t n = 0; ok && n < stored.size(); n++) {
+      reader.read(n, read);
+      ok = reader.step_number(n) == stored[n] && read.x[0] == stored[n];
+    }
+  }
+  std::filesystem::remove(whole);
+  std::filesystem::remove(gapped);
+  return ok;
+}
+
+// Records the golden trajectory with the pairwise solver. Only do it with a
+// build that is known to be right, as everything is checked against it.
+// Written with the built in codec so every build can read it. Throws
+// std::runtime_error.
+inline int record_golden(const BenchOptions &options) {
+  const std::vector<Bodies> steps = regression_run(force_settings().front(), 1);
+  SimulationState state;
+  state.gravitational_constant = regression_gravitational_constant;
+  TrajectoryWriter writer(options.golden_path, steps[0], state,
+                          Codec::run_length, (uint)steps.size(),
+                          regression_stride);
+  for (size_t step = 0; step < steps.size(); step++)
+    writer.append(steps[step], step * regression_stride);
+  writer.close();
+  if (writer.failed())
+    throw std::runtime_error("can't write " + options.golden_path);
+  std::cout << std::format("wrote the golden trajectory of {} bodies and {} "
+                           "updates to {}\n",
+                           regression_bodies, regression_updates,
+                           options.golden_path);
+  return 0;
+}
+
+// Runs every force setting at 1, 2, 4, ... threads and checks that it stays
+// within its tolerance of the golden trajectory, and that the parallel
+// solver, which adds up every body's pairs in the same order whatever the
+// threads, gives the same bits at every thread count. A missing golden
+// trajectory fails too. Returns the exit code, throws std::runtime_error if
+// the golden trajectory can't be read.
+inline int regression_check(const BenchOptions &options) {
+  if (!std::filesystem::exists(options.regression_path)) {
+    std::cerr << "no golden trajectory at " << options.regression_path
+              << ", record one with --record-golden\n";
+    return 1;
+  }
+
+  TrajectoryReader reader(options.regression_path);
+  std::vector<Bodies> golden(reader.steps());
+  for (size_t step = 0; step < golden.size(); step++)
+    reader.read(step, golden[step]);
+  if (golden.size() != regression_updates / regression_stride + 1 ||
+      reader.step_stride() != regression_stride ||
+      reader.number_of_bodies() != regression_bodies ||
+      reader.file_header().gravitational_constant !=
+          regression_gravitational_constant) {
+    std::cerr << options.regression_path
+              << " is the golden trajectory of another system, record it "
+                 "again with --record-golden\n";
+    return 1;
+  }
+
+  std::cout << std::format("{:<18}{:>9}{:>13}{:>13}{:>9}{:>12}{:>8}\n",
+                           "setting", "threads", "error", "tolerance",
+                           "bitwise", "same bits", "result");
+  bool passed = true;
+  for (const ForceSetting &setting : force_settings()) {
+    const std::string name = std::string("force/") + setting.solver_name +
+                             "/" + setting.precision_name;
+    if (!name.starts_with(options.only))
+      continue;
+    // threads don't matter to the pairwise solver
+    const std::vector<unsigned> counts =
+        setting.solver == Solver::parallel
+            ? scaling_thread_counts(std::max(4u, thread_count()))
+            : std::vector<unsigned>{1};
+    std::vector<Bodies> single;
+    for (unsigned threads : counts) {
+      const std::vector<Bodies> run = regression_run(setting, threads);
+      const TrajectoryDifference difference = compare_trajectories(run, golden);
+      // every thread count gives what 1 thread does
+      const bool deterministic =
+          threads == 1 || compare_trajectories(run, single).bitwise;
+      if (threads == 1)
+        single = run;
+      const double tolerance = regression_tolerance(setting);
+      const bool ok = difference.error <= tolerance && deterministic;
+      passed = passed && ok;
+      std::cout << std::format(
+          "{:<18}{:>9}{:>13.3e}{:>13.0e}{:>9}{:>12}{:>8}\n", name.substr(6),
+          threads, difference.error, tolerance,
+          difference.bitwise ? "yes" : "no",
+          threads == 1 ? "-" : deterministic ? "yes" : "no",
+          ok ? "ok" : "FAILED");
+    }
+  }
+  set_thread_count(options.threads);
+
+  const bool philox_ok = check_philox();
+  std::cout << std::format("{:<62}{:>8}\n", "philox4x32-10 known answers",
+                           philox_ok ? "ok" : "FAILED");
+  passed = passed && philox_ok;
+  const bool shm_ok = check_shared_memory();
+  std::cout << std::format("{:<62}{:>8}\n", "shared memory snapshots",
+                           shm_ok ? "ok" : "FAILED");
+  passed = passed && shm_ok;
+  const bool gap_ok = check_trajectory_gap();
+  std::cout << std::format("{:<62}{:>8}\n", "trajectory missing a chunk",
+                           gap_ok ? "ok" : "FAILED");
+  passed = passed && gap_ok;
+  return passed ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  try {
+    options = parse_bench_options(argc, argv);
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << '\n' << bench_usage();
+    return 1;
+  }
+  set_thread_count(options.threads);
+  set_thread_pinning(options.pin_threads);
+  if (!options.pareto_path.empty())
+    return pareto_sweep(options);
+  if (!options.scaling_path.empty())
+    return scaling_sweep(options);
+  if (!options.regression_path.empty() || !options.golden_path.empty()) {
+    try {
+      return options.golden_path.empty() ? regression_check(options)
+                                         : record_golden(options);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
+  std::vector<size_t> sizes = options.sizes;
+  std::sort(sizes.begin(), sizes.end());
+
+  std::cout << std::format("{} threads, {} warmup and {} timed runs\n\n",
+                           thread_count(), options.warmup, options.repetitions);
+  std::cout << std::format("{:<24}{:>9}{:>13}{:>13}{:>13}{:>14}{:>10}{:>12}\n",
+                           "case", "n", "median ms", "p10 ms", "p90 ms",
+                           "pairs/s", "GFLOP/s", "ns/body");
+
+  std::vector<BenchResult> results;
+  for (const BenchCase &bench_case : bench_cases()) {
+    if (!bench_case.name.starts_with(options.only))
+      continue;
+    // seconds per unit of cost of the last size, to guess the next one
+    double seconds_per_cost = 0;
+    for (size_t n : sizes) {
+      const double expected = seconds_per_cost * bench_case.cost(n) *
+                              (options.warmup + options.repetitions);
+      if (expected > options.max_seconds) {
+        std::cout << std::format("{:<24}{:>9}  skipped, about {:.0f} s\n",
+                                 bench_case.name, n, expected);
+        continue;
+      }
+
+      Bodies bodies;
+      generate_uniform_cube(bodies, n, 1);
+      const BenchResult result = measure(bench_case, bodies, options);
+      seconds_per_cost = result.median() / bench_case.cost(n);
+
+      std::cout << std::format("{:<24}{:>9}{:>13.3f}{:>13.3f}{:>13.3f}",
+                               result.name, result.n, result.median() * 1e3,
+                               result.percentile(10) * 1e3,
+                               result.percentile(90) * 1e3);
+      if (result.interactions > 0)
+        std::cout << std::format("{:>14.4g}{:>10.2f}",
+                                 result.interactions_per_second(),
+                                 result.gflops());
+      else
+        std::cout << std::format("{:>14}{:>10}", "-", "-");
+      std::cout << std::format("{:>12.2f}\n",
+                               result.nanoseconds_per_body_step());
+      results.push_back(result);
+    }
+  }
+
+  if (!options.json_path.empty()) {
+    const std::string json = results_json(results, options);
+    if (options.json_path == "-") {
+      std::cout << json;
+    } else {
+      std::ofstream file(options.json_path);
+      file << json;
+      if (!file) {
+        std::cerr << "can't write " << options.json_path << '\n';
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "memory.hpp"
+
+typedef unsigned int uint;
+
+struct Body {
+  double x, y, z;    // position of the mass centers will be the body
+  double vx, vy, vz; // velocity
+  double mass;
+
+  std::string to_string() const {
+    return std::format("position: {}, {}, {} | velocity: {}, {}, {} | mass: {}",
+                       x, y, z, vx, vy, vz, mass);
+  }
+};
+
+// One member of every body in a contiguous array that starts on a cache line
+// so SIMD loads never split a line. A column usually owns its memory but can
+// also be a view of memory kept alive by someone else, like a memory mapped
+// checkpoint, so loading doesn't copy. Copying always makes an owned copy and
+// so does resizing a view. Owned memory is charged to the subsystem of the
+// MemoryScope it was allocated in.
+class Column {
+public:
+  Column() = default;
+  explicit Column(size_t size) { resize(size); }
+  Column(const Column &other) { assign(other.begin(), other.end()); }
+  Column(Column &&other) noexcept { swap(other); }
+  Column &operator=(const Column &other) {
+    if (this != &other)
+      assign(other.begin(), other.end());
+    return *this;
+  }
+  Column &operator=(Column &&other) noexcept {
+    Column moved(std::move(other));
+    swap(moved);
+    return *this;
+  }
+  ~Column() { release(); }
+
+  // A column of size values at values, valid as long as owner is alive.
+  static Column view(double *values, size_t size,
+                     std::shared_ptr<void> owner) {
+    Column column;
+    column.values = values;
+    column.length = column.capacity = size;
+    column.owner = std::move(owner);
+    return column;
+  }
+
+  size_t size() const { return length; }
+  // Whether the values are a view of memory the column doesn't own, e.g. a
+  // mapped file.
+  bool is_view() const { return (bool)owner; }
+  double *data() { return values; }
+  const double *data() const { return values; }
+  double &operator[](size_t i) { return values[i]; }
+  const double &operator[](size_t i) const { return values[i]; }
+  double *begin() { return values; }
+  double *end() { return values + length; }
+  const double *begin() const { return values; }
+  const double *end() const { return values + length; }
+
+  // Keeps the values that fit, new values are 0.
+  void resize(size_t size) {
+    if (owner || size > capacity) {
+      double *resized = allocate(size);
+      std::copy(values, values + std::min(size, length), resized);
+      std::fill(resized + std::min(size, length), resized + size, 0.0);
+      release();
+      values = resized;
+      capacity = size;
+      charge();
+    } else if (size > length) {
+      std::fill(values + length, values + size, 0.0);
+    }
+    length = size;
+  }
+
+  template <typename Iterator> void assign(Iterator first, Iterator last) {
+    const size_t size = std::distance(first, last);
+    if (owner || size > capacity) {
+      double *assigned = allocate(size);
+      release();
+      values = assigned;
+      capacity = size;
+      charge();
+    }
+    std::copy(first, last, values);
+    length = size;
+  }
+
+private:
+  static constexpr size_t alignment = 64;
+
+  static double *allocate(size_t size) {
+    return (double *)::operator new(std::max<size_t>(1, size) * sizeof(double),
+                                    std::align_val_t(alignment));
+  }
+
+  void charge() {
+    charged = current_subsystem();
+    memory_account().allocated(charged, capacity * sizeof(double));
+  }
+
+  void release() {
+    if (owner) {
+      owner.reset();
+    } else if (values) {
+      memory_account().freed(charged, capacity * sizeof(double));
+      ::operator delete(values, std::align_val_t(alignment));
+    }
+    values = nullptr;
+    length = capacity = 0;
+  }
+
+  void swap(Column &other) {
+    std::swap(values, other.values);
+    std::swap(length, other.length);
+    std::swap(capacity, other.capacity);
+    std::swap(owner, other.owner);
+    std::swap(charged, other.charged);
+  }
+
+  double *values = nullptr;
+  size_t length = 0, capacity = 0;
+  std::shared_ptr<void> owner; // only set for views
+  Subsystem charged = Subsystem::bodies;
+};
+
+// All the bodies, one column per member (structure of arrays). A pass that
+// only needs positions streams through three arrays instead of skipping over
+// velocities and mass, and every column can be loaded straight into SIMD
+// registers.
+struct Bodies {
+  Column x, y, z;    // position of the mass centers will be the body
+  Column vx, vy, vz; // velocity
+  Column mass;
+
+  Bodies() = default;
+  explicit Bodies(size_t size) { resize(size); }
+
+  size_t size() const { return x.size(); }
+
+  void resize(size_t size) {
+    for (Column *column : {&x, &y, &z, &vx, &vy, &vz, &mass})
+      column->resize(size);
+  }
+
+  Body get(size_t i) const {
+    return {x[i], y[i], z[i], vx[i], vy[i], vz[i], mass[i]};
+  }
+
+  void set(size_t i, const Body &body) {
+    x[i] = body.x;
+    y[i] = body.y;
+    z[i] = body.z;
+    vx[i] = body.vx;
+    vy[i] = body.vy;
+    vz[i] = body.vz;
+    mass[i] = body.mass;
+  }
+};
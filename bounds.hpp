@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "body.hpp"
+#include "parallel.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// The box the bodies are in, plus the sum of their positions so the center
+// comes out of the same sweep. Computed once per update and handed to the
+// renderers and the recentring instead of each of them looping over every
+// body again.
+struct Bounds {
+  double lowest_x = std::numeric_limits<double>::infinity();
+  double lowest_y = std::numeric_limits<double>::infinity();
+  double lowest_z = std::numeric_limits<double>::infinity();
+  double highest_x = -std::numeric_limits<double>::infinity();
+  double highest_y = -std::numeric_limits<double>::infinity();
+  double highest_z = -std::numeric_limits<double>::infinity();
+  double sum_x = 0, sum_y = 0, sum_z = 0;
+  size_t count = 0;
+
+  // Grow to also hold other. Summing in a fixed order keeps the center the
+  // same however many threads computed the parts.
+  void merge(const Bounds &other) {
+    lowest_x = std::min(lowest_x, other.lowest_x);
+    lowest_y = std::min(lowest_y, other.lowest_y);
+    lowest_z = std::min(lowest_z, other.lowest_z);
+    highest_x = std::max(highest_x, other.highest_x);
+    highest_y = std::max(highest_y, other.highest_y);
+    highest_z = std::max(highest_z, other.highest_z);
+    sum_x += other.sum_x;
+    sum_y += other.sum_y;
+    sum_z += other.sum_z;
+    count += other.count;
+  }
+
+  // Keep the bounds right after every body was moved by the same offset.
+  void translate(double x, double y, double z) {
+    lowest_x += x;
+    lowest_y += y;
+    lowest_z += z;
+    highest_x += x;
+    highest_y += y;
+    highest_z += z;
+    sum_x += x * count;
+    sum_y += y * count;
+    sum_z += z * count;
+  }
+
+  double center_x() const { return sum_x / count; }
+  double center_y() const { return sum_y / count; }
+  double center_z() const { return sum_z / count; }
+};
+
+// Lowest, highest and sum of values[begin, end) without branches. Uses 4 or 2
+// wide SIMD lanes where the compiler targets them and plain min/max otherwise.
+inline void column_bounds(const double *values, size_t begin, size_t end,
+                          double &lowest, double &highest, double &sum) {
+  size_t i = begin;
+#if defined(__AVX__)
+  __m256d low = _mm256_set1_pd(lowest), high = _mm256_set1_pd(highest);
+  __m256d total = _mm256_setzero_pd();
+  for (; i + 4 <= end; i += 4) {
+    const __m256d v = _mm256_loadu_pd(values + i);
+    low = _mm256_min_pd(low, v);
+    high = _mm256_max_pd(high, v);
+    total = _mm256_add_pd(total, v);
+  }
+  alignas(32) double lanes[3][4];
+  _mm256_store_pd(lanes[0], low);
+  _mm256_store_pd(lanes[1], high);
+  _mm256_store_pd(lanes[2], total);
+  for (int lane = 0; lane < 4; lane++) {
+    lowest = std::min(lowest, lanes[0][lane]);
+    highest = std::max(highest, lanes[1][lane]);
+    sum += lanes[2][lane];
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  __m128d low = _mm_set1_pd(lowest), high = _mm_set1_pd(highest);
+  __m128d total = _mm_setzero_pd();
+  for (; i + 2 <= end; i += 2) {
+    const __m128d v = _mm_loadu_pd(values + i);
+    low = _mm_min_pd(low, v);
+    high = _mm_max_pd(high, v);
+    total = _mm_add_pd(total, v);
+  }
+  alignas(16) double lanes[3][2];
+  _mm_store_pd(lanes[0], low);
+  _mm_store_pd(lanes[1], high);
+  _mm_store_pd(lanes[2], total);
+  for (int lane = 0; lane < 2; lane++) {
+    lowest = std::min(lowest, lanes[0][lane]);
+    highest = std::max(highest, lanes[1][lane]);
+    sum += lanes[2][lane];
+  }
+#endif
+  for (; i < end; i++) {
+    lowest = std::min(lowest, values[i]);
+    highest = std::max(highest, values[i]);
+    sum += values[i];
+  }
+}
+
+// Bounds of the bodies in one parallel sweep over the position columns. The
+// bodies are cut into fixed size blocks rather than one chunk per thread so
+// the sums, and so the center, don't depend on the thread count.
+inline Bounds compute_bounds(const Bodies &bodies) {
+  constexpr size_t block_size = 16384;
+  const size_t n = bodies.size();
+  const size_t blocks = (n + block_size - 1) / block_size;
+  std::vector<Bounds> block_bounds(blocks);
+
+  parallel_for(
+      blocks,
+      [&](size_t first_block, size_t last_block, unsigned) {
+        for (size_t block = first_block; block < last_block; block++) {
+          const size_t begin = block * block_size;
+          const size_t end = std::min(n, begin + block_size);
+          Bounds &bounds = block_bounds[block];
+          column_bounds(bodies.x.data(), begin, end, bounds.lowest_x,
+                        bounds.highest_x, bounds.sum_x);
+          column_bounds(bodies.y.data(), begin, end, bounds.lowest_y,
+                        bounds.highest_y, bounds.sum_y);
+          column_bounds(bodies.z.data(), begin, end, bounds.lowest_z,
+                        bounds.highest_z, bounds.sum_z);
+          bounds.count = end - begin;
+        }
+      },
+      1);
+
+  Bounds bounds;
+  for (const Bounds &block : block_bounds)
+    bounds.merge(block);
+  return bounds;
+}
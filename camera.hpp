@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "parallel.hpp"
+
+// How the map decides what area to show.
+enum class MapCameraMode {
+  exact,      // the bounds of every body, recomputed every update
+  fixed,      // a fixed box around (0, 0, 0)
+  percentile, // the bounds of all but the outermost bodies on each axis
+  smoothed    // the exact bounds, eased towards over several updates
+};
+
+// Picks the area the map and images show. With the exact bounds a single
+// escaping body squashes everything else into one cell, the other modes
+// ignore it or follow it slowly. Keeps state between updates for smoothing.
+struct MapCamera {
+  MapCameraMode mode = MapCameraMode::exact;
+  // fixed: half the size of the box on every axis
+  double extent = 1000;
+  // percentile: percent of bodies left out on each side of every axis
+  double percentile = 1;
+  // smoothed: how far to move towards the exact bounds every update, 0 to 1
+  double smoothing = 0.1;
+
+  // The bounds to draw with this update given the exact bounds of bodies.
+  Bounds view(const Bodies &bodies, const Bounds &exact) {
+    Bounds view = exact;
+    switch (mode) {
+    case MapCameraMode::exact:
+      break;
+    case MapCameraMode::fixed:
+      view.lowest_x = view.lowest_y = view.lowest_z = -extent;
+      view.highest_x = view.highest_y = view.highest_z = extent;
+      break;
+    case MapCameraMode::percentile:
+      percentile_bounds(bodies, view);
+      break;
+    case MapCameraMode::smoothed:
+      if (!has_smoothed) {
+        smoothed = exact;
+        has_smoothed = true;
+      }
+      ease(smoothed.lowest_x, exact.lowest_x);
+      ease(smoothed.lowest_y, exact.lowest_y);
+      ease(smoothed.lowest_z, exact.lowest_z);
+      ease(smoothed.highest_x, exact.highest_x);
+      ease(smoothed.highest_y, exact.highest_y);
+      ease(smoothed.highest_z, exact.highest_z);
+      view.lowest_x = smoothed.lowest_x;
+      view.lowest_y = smoothed.lowest_y;
+      view.lowest_z = smoothed.lowest_z;
+      view.highest_x = smoothed.highest_x;
+      view.highest_y = smoothed.highest_y;
+      view.highest_z = smoothed.highest_z;
+      break;
+    }
+    return view;
+  }
+
+  // The bounds move with the bodies when the update loop recenters them.
+  void translate(double x, double y, double z) {
+    if (has_smoothed)
+      smoothed.translate(x, y, z);
+  }
+
+private:
+  void ease(double &current, double target) const {
+    current += (target - current) * smoothing;
+  }
+
+  // Select the low and high percentile of every axis with nth_element, which
+  // is O(N), instead of sorting. The three axes run on their own threads.
+  void percentile_bounds(const Bodies &bodies, Bounds &view) {
+    const size_t n = bodies.size();
+    // at most the median, so the low one is never above the high one
+    const size_t skip = std::min(
+        (n - 1) / 2, (size_t)(n * std::clamp(percentile, 0.0, 50.0) / 100));
+    const std::array<const Column *, 3> columns = {&bodies.x, &bodies.y,
+                                                   &bodies.z};
+    const std::array<double *, 3> lowest = {&view.lowest_x, &view.lowest_y,
+                                            &view.lowest_z};
+    const std::array<double *, 3> highest = {&view.highest_x, &view.highest_y,
+                                             &view.highest_z};
+
+    parallel_for(
+        3,
+        [&](size_t begin, size_t end, unsigned) {
+          for (size_t axis = begin; axis < end; axis++) {
+            Column &values = scratch[axis];
+            values.assign(columns[axis]->begin(), columns[axis]->end());
+            // The high one first, then the low one only has to look at what
+            // ended up below it.
+            auto high = values.begin() + (n - 1 - skip);
+            std::nth_element(values.begin(), high, values.end());
+            *highest[axis] = *high;
+            auto low = values.begin() + skip;
+            if (low < high)
+              std::nth_element(values.begin(), low, high);
+            *lowest[axis] = *low;
+          }
+        },
+        1);
+  }
+
+  Bounds smoothed;
+  bool has_smoothed = false;
+  std::array<Column, 3> scratch; // reused so selecting doesn't allocate
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "body.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+// How velocities and positions are advanced every update.
+enum class Integrator : uint32_t {
+  drift_kick = 0 // move by velocity, then add the acceleration (euler)
+};
+
+// Everything besides the bodies needed to carry on a run where it stopped.
+struct SimulationState {
+  uint64_t update_count = 0;
+  double gravitational_constant = 1;
+  double time_step = 1; // simulated time per update
+  Integrator integrator = Integrator::drift_kick;
+
+  double time() const { return update_count * time_step; }
+};
+
+// On disk a checkpoint is this header followed by the 7 body columns, each
+// starting on its own page so a memory mapped column is aligned for SIMD.
+// Numbers are stored in the native byte order, the endian field tells a
+// reader on another machine that it can't use the file.
+struct CheckpointHeader {
+  static constexpr std::array<char, 8> expected_magic = {'N', 'B', 'O', 'D',
+                                                         'Y', 'C', 'K', 'P'};
+  static constexpr uint32_t current_version = 1;
+  static constexpr uint32_t native_endian = 0x01020304;
+  static constexpr size_t column_alignment = 4096;
+  static constexpr size_t columns = 7;
+
+  std::array<char, 8> magic = expected_magic;
+  uint32_t version = current_version;
+  uint32_t endian = native_endian;
+  uint64_t number_of_bodies = 0;
+  uint64_t update_count = 0;
+  double gravitational_constant = 0;
+  double time = 0;
+  double time_step = 0;
+  uint32_t integrator = 0;
+  uint32_t reserved = 0;
+  // byte offsets of x, y, z, vx, vy, vz and mass from the start of the file
+  std::array<uint64_t, columns> column_offsets{};
+};
+
+inline std::array<const Column *, CheckpointHeader::columns>
+columns_of(const Bodies &bodies) {
+  return {&bodies.x,  &bodies.y,  &bodies.z,   &bodies.vx,
+          &bodies.vy, &bodies.vz, &bodies.mass};
+}
+
+inline std::array<Column *, CheckpointHeader::columns> columns_of(Bodies &bodies) {
+  return {&bodies.x,  &bodies.y,  &bodies.z,   &bodies.vx,
+          &bodies.vy, &bodies.vz, &bodies.mass};
+}
+
+// Write a checkpoint to path. It is written next to it first and renamed over
+// it at the end, so a run killed halfway leaves the previous checkpoint
+// intact.
+inline void write_checkpoint(const std::string &path, const Bodies &bodies,
+                             const SimulationState &state) {
+  CheckpointHeader header;
+  header.number_of_bodies = bodies.size();
+  header.update_count = state.update_count;
+  header.gravitational_constant = state.gravitational_constant;
+  header.time = state.time();
+  header.time_step = state.time_step;
+  header.integrator = (uint32_t)state.integrator;
+
+  const auto align = [](uint64_t offset) {
+    return (offset + CheckpointHeader::column_alignment - 1) /
+           CheckpointHeader::column_alignment *
+           CheckpointHeader::column_alignment;
+  };
+  uint64_t offset = align(sizeof(CheckpointHeader));
+  for (uint64_t &column_offset : header.column_offsets) {
+    column_offset = offset;
+    offset = align(offset + bodies.size() * sizeof(double));
+  }
+
+  const std::string temporary_path = path + ".tmp";
+  std::FILE *file = std::fopen(temporary_path.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("can't write checkpoint " + temporary_path);
+
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  uint64_t written = sizeof(header);
+  const std::array<char, CheckpointHeader::column_alignment> padding{};
+  const auto columns = columns_of(bodies);
+  for (size_t c = 0; c < columns.size() && ok; c++) {
+    ok = std::fwrite(padding.data(), 1, header.column_offsets[c] - written,
+                     file) == header.column_offsets[c] - written;
+    ok = ok && std::fwrite(columns[c]->data(), sizeof(double),
+                           columns[c]->size(),
+                           file) == columns[c]->size();
+    written = header.column_offsets[c] + columns[c]->size() * sizeof(double);
+  }
+  ok = ok && std::fflush(file) == 0;
+#if !defined(_WIN32)
+  // make sure it is on disk before it replaces the last good checkpoint
+  ok = ok && fsync(fileno(file)) == 0;
+#endif
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok)
+    throw std::runtime_error("can't write checkpoint " + temporary_path);
+
+  std::filesystem::rename(temporary_path, path);
+}
+
+// Load a checkpoint by memory mapping it. The columns of bodies become views
+// into the private mapping, nothing is parsed or copied and pages are read
+// from disk as the first update touches them.
+inline void load_checkpoint(const std::string &path, Bodies &bodies,
+                            SimulationState &state) {
+  auto file = std::make_shared<MappedFile>(path,
+                                           MappedFile::Access::private_copy);
+
+  CheckpointHeader header;
+  if (file->size() < sizeof(header))
+    throw std::runtime_error(path + " is too small to be a checkpoint");
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (header.magic != CheckpointHeader::expected_magic)
+    throw std::runtime_error(path + " is not a checkpoint");
+  if (header.endian != CheckpointHeader::native_endian)
+    throw std::runtime_error(path + " was written with another byte order");
+  if (header.version != CheckpointHeader::current_version)
+    throw std::runtime_error(path + " is checkpoint version " +
+                             std::to_string(header.version) +
+                             ", this build reads version " +
+                             std::to_string(CheckpointHeader::current_version));
+  for (uint64_t offset : header.column_offsets) {
+    if (offset % alignof(double) != 0 ||
+        offset + header.number_of_bodies * sizeof(double) > file->size())
+      throw std::runtime_error(path + " is truncated");
+  }
+
+  state.update_count = header.update_count;
+  state.gravitational_constant = header.gravitational_constant;
+  state.time_step = header.time_step;
+  state.integrator = (Integrator)header.integrator;
+
+  const auto columns = columns_of(bodies);
+  for (size_t c = 0; c < columns.size(); c++) {
+    *columns[c] = Column::view(
+        (double *)(file->data() + header.column_offsets[c]),
+        header.number_of_bodies, file);
+  }
+}
+
+// Writes checkpoints on a background thread from a copy of the bodies, so
+// the update loop only pays for the copy. If the last checkpoint is still
+// being written the new one is skipped rather than queued.
+class CheckpointWriter {
+public:
+  explicit CheckpointWriter(std::string path)
+      : path(std::move(path)), writer(1) {}
+
+  // False when skipped because the previous checkpoint isn't done.
+  bool save(const Bodies &bodies, const SimulationState &state) {
+    if (writer.pending() > 0)
+      return false;
+    MemoryScope scope(Subsystem::io);
+    auto snapshot = std::make_shared<const Bodies>(bodies);
+    writer.submit([this, snapshot, state] {
+      try {
+        write_checkpoint(path, *snapshot, state);
+      } catch (const std::exception &) {
+        failed_checkpoints++;
+      }
+    });
+    return true;
+  }
+
+  uint failures() const { return failed_checkpoints; }
+
+private:
+  std::string path;
+  std::atomic<uint> failed_checkpoints = 0;
+  ThreadPool writer; // last so it finishes the checkpoint being written first
+};
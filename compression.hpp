@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// zstd and LZ4 are used when the build finds them, see CMakeLists.txt.
+#if defined(NBODY_WITH_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(NBODY_WITH_LZ4)
+#include <lz4.h>
+#endif
+
+enum class Codec : uint32_t {
+  none = 0,
+  run_length = 1, // built in, always available
+  lz4 = 2,
+  zstd = 3
+};
+
+inline bool codec_available(Codec codec) {
+  switch (codec) {
+  case Codec::none:
+  case Codec::run_length:
+    return true;
+  case Codec::lz4:
+#if defined(NBODY_WITH_LZ4)
+    return true;
+#else
+    return false;
+#endif
+  case Codec::zstd:
+#if defined(NBODY_WITH_ZSTD)
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+// The best codec this build has.
+inline Codec best_codec() {
+  if (codec_available(Codec::zstd))
+    return Codec::zstd;
+  if (codec_available(Codec::lz4))
+    return Codec::lz4;
+  return Codec::run_length;
+}
+
+inline const char *codec_name(Codec codec) {
+  switch (codec) {
+  case Codec::none:
+    return "none";
+  case Codec::run_length:
+    return "run-length";
+  case Codec::lz4:
+    return "lz4";
+  case Codec::zstd:
+    return "zstd";
+  }
+  return "unknown";
+}
+
+// Replace every value after the first row of row_length values by its bits
+// XORed with the value one row before. Consecutive steps of a body barely
+// move, so the high bytes become zero. Run backwards so it works in place.
+inline void xor_delta(uint64_t *values, size_t rows, size_t row_length) {
+  for (size_t i = rows * row_length; i-- > row_length;)
+    values[i] ^= values[i - row_length];
+}
+
+inline void undo_xor_delta(uint64_t *values, size_t rows, size_t row_length) {
+  for (size_t i = row_length; i < rows * row_length; i++)
+    values[i] ^= values[i - row_length];
+}
+
+// Regroup count 8 byte values so byte 0 of every value comes first, then
+// byte 1 and so on. Bytes that are mostly equal (sign, exponent, zeros left by
+// xor_delta) end up next to each other where codecs squeeze them well.
+inline void shuffle_bytes(const uint8_t *input, uint8_t *output, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    for (size_t b = 0; b < 8; b++)
+      output[b * count + i] = input[i * 8 + b];
+}
+
+inline void unshuffle_bytes(const uint8_t *input, uint8_t *output,
+                            size_t count) {
+  for (size_t i = 0; i < count; i++)
+    for (size_t b = 0; b < 8; b++)
+      output[i * 8 + b] = input[b * count + i];
+}
+
+// Built in codec for when there is no zstd or LZ4. Control byte c below 128
+// is followed by c + 1 literal bytes, c from 128 means the next byte repeats
+// c - 125 times (3 to 130). Shuffled, delta coded columns are mostly long
+// runs so this gets much of what a real codec would at memcpy speed.
+inline void run_length_encode(const uint8_t *input, size_t size,
+                              std::vector<uint8_t> &output) {
+  // worst case is all literals, one control byte per 128
+  const size_t start = output.size();
+  output.resize(start + size + size / 128 + 1);
+  uint8_t *out = output.data() + start;
+
+  size_t literal_start = 0;
+  const auto flush_literals = [&](size_t end) {
+    while (literal_start < end) {
+      const size_t length = std::min<size_t>(128, end - literal_start);
+      *out++ = (uint8_t)(length - 1);
+      std::memcpy(out, input + literal_start, length);
+      out += length;
+      literal_start += length;
+    }
+  };
+  for (size_t i = 0; i + 2 < size;) {
+    // most bytes start no run, check that with two compares
+    if (input[i] != input[i + 1] || input[i] != input[i + 2]) {
+      i++;
+      continue;
+    }
+    size_t run = 3;
+    while (i + run < size && run < 130 && input[i + run] == input[i])
+      run++;
+    flush_literals(i);
+    *out++ = (uint8_t)(run + 125);
+    *out++ = input[i];
+    i += run;
+    literal_start = i;
+  }
+  flush_literals(size);
+  output.resize(out - output.data());
+}
+
+inline void run_length_decode(const uint8_t *input, size_t size,
+                              uint8_t *output, size_t output_size) {
+  size_t o = 0;
+  for (size_t i = 0; i < size;) {
+    const uint8_t control = input[i++];
+    if (control < 128) {
+      const size_t length = control + 1;
+      if (i + length > size || o + length > output_size)
+        throw std::runtime_error("corrupt run-length data");
+      std::memcpy(output + o, input + i, length);
+      i += length;
+      o += length;
+    } else {
+      const size_t length = control - 125;
+      if (i >= size || o + length > output_size)
+        throw std::runtime_error("corrupt run-length data");
+      std::memset(output + o, input[i++], length);
+      o += length;
+    }
+  }
+  if (o != output_size)
+    throw std::runtime_error("corrupt run-length data");
+}
+
+// Compress size bytes with codec, appending to output.
+inline void compress(Codec codec, const uint8_t *input, size_t size,
+                     std::vector<uint8_t> &output) {
+  switch (codec) {
+  case Codec::none:
+    output.insert(output.end(), input, input + size);
+    return;
+  case Codec::run_length:
+    run_length_encode(input, size, output);
+    return;
+  case Codec::lz4: {
+#if defined(NBODY_WITH_LZ4)
+    if (size > (size_t)LZ4_MAX_INPUT_SIZE)
+      throw std::runtime_error("too much data for one LZ4 block");
+    const size_t start = output.size();
+    output.resize(start + LZ4_compressBound((int)size));
+    const int written =
+        LZ4_compress_default((const char *)input, (char *)output.data() + start,
+                             (int)size, (int)(output.size() - start));
+    if (written <= 0)
+      throw std::runtime_error("LZ4 compression failed");
+    output.resize(start + written);
+    return;
+#else
+    break;
+#endif
+  }
+  case Codec::zstd: {
+#if defined(NBODY_WITH_ZSTD)
+    const size_t start = output.size();
+    output.resize(start + ZSTD_compressBound(size));
+    // level 1 keeps up with the simulation, higher levels don't pay off on
+    // shuffled doubles
+    const size_t written = ZSTD_compress(output.data() + start,
+                                         output.size() - start, input, size, 1);
+    if (ZSTD_isError(written))
+      throw std::runtime_error(std::string("zstd compression failed: ") +
+                               ZSTD_getErrorName(written));
+    output.resize(start + written);
+    return;
+#else
+    break;
+#endif
+  }
+  }
+  throw std::runtime_error(std::string("this build has no ") +
+                           codec_name(codec) + " support");
+}
+
+// Decompress exactly output_size bytes.
+inline void decompress(Codec codec, const uint8_t *input, size_t size,
+                       uint8_t *output, size_t output_size) {
+  switch (codec) {
+  case Codec::none:
+    if (size != output_size)
+      throw std::runtime_error("stored data has the wrong size");
+    std::memcpy(output, input, size);
+    return;
+  case Codec::run_length:
+    run_length_decode(input, size, output, output_size);
+    return;
+  case Codec::lz4:
+#if defined(NBODY_WITH_LZ4)
+    if (LZ4_decompress_safe((const char *)input, (char *)output, (int)size,
+                            (int)output_size) != (int)output_size)
+      throw std::runtime_error("corrupt LZ4 data");
+    return;
+#else
+    break;
+#endif
+  case Codec::zstd:
+#if defined(NBODY_WITH_ZSTD)
+    if (ZSTD_decompress(output, output_size, input, size) != output_size)
+      throw std::runtime_error("corrupt zstd data");
+    return;
+#else
+    break;
+#endif
+  }
+  throw std::runtime_error(std::string("this build has no ") +
+                           codec_name(codec) + " support");
+}
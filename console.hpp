@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "parallel.hpp"
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Console output off the update loop. Each update hands over its whole frame
+// (map and status line) as strings and a writer thread clears the screen and
+// writes them with one writev() straight to the file descriptor, no iostream
+// or stdio buffering in between. A terminal that can't keep up costs frames,
+// never updates: while the last frame is still being written a new one is
+// dropped rather than queued.
+class ConsoleOutput {
+public:
+  explicit ConsoleOutput(int fd = 1) : fd(fd), writer(1) {}
+
+  // False when dropped because the previous frame isn't written yet.
+  bool submit(std::string frame, std::string status) {
+    if (writer.pending() > 0) {
+      dropped_frames++;
+      return false;
+    }
+    auto text = std::make_shared<std::pair<std::string, std::string>>(
+        std::move(frame), std::move(status));
+    writer.submit([this, text] { write(text->first, text->second); });
+    return true;
+  }
+
+  unsigned dropped() const { return dropped_frames; }
+
+private:
+  // Runs on the writer thread.
+  void write(const std::string &frame, const std::string &status) {
+#if defined(_WIN32)
+    (void)fd;
+    system("cls");
+    std::fwrite(frame.data(), 1, frame.size(), stdout);
+    std::fwrite(status.data(), 1, status.size(), stdout);
+    std::fflush(stdout);
+#else
+    // home the cursor and clear the screen, what clear(1) prints, without
+    // starting a process every frame
+    static const char clear[] = "\033[H\033[2J\033[3J";
+    iovec parts[3] = {{(void *)clear, sizeof(clear) - 1},
+                      {(void *)frame.data(), frame.size()},
+                      {(void *)status.data(), status.size()}};
+    iovec *part = parts;
+    int remaining = 3;
+    while (remaining > 0) {
+      const ssize_t written = writev(fd, part, remaining);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        return; // nowhere to write to, drop the rest
+      }
+      // carry on after a short write
+      size_t left = (size_t)written;
+      while (remaining > 0 && left >= part->iov_len) {
+        left -= part->iov_len;
+        part++;
+        remaining--;
+      }
+      if (remaining > 0) {
+        part->iov_base = (char *)part->iov_base + left;
+        part->iov_len -= left;
+      }
+    }
+#endif
+  }
+
+  int fd;
+  std::atomic<unsigned> dropped_frames = 0;
+  ThreadPool writer; // last so the frame being written finishes first
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "body.hpp"
+#include "parallel.hpp"
+
+// Conserved quantities of the bodies at one step. The force loop conserves
+// all of them exactly in exact arithmetic and with an infinitely small time
+// step, so how far they drift shows what a solver or time step costs in
+// accuracy.
+struct Diagnostics {
+  uint64_t step = 0;
+  double kinetic = 0;
+  double potential = 0; // from the force loop, see pair_potential
+  std::array<double, 3> momentum{};
+  // around the centre of mass, so recentring doesn't change it
+  std::array<double, 3> angular_momentum{};
+
+  double energy() const { return kinetic + potential; }
+};
+
+// Everything but the potential, which the force loop adds up for free, in one
+// parallel sweep over the bodies.
+inline Diagnostics measure_diagnostics(const Bodies &bodies, double potential,
+                                       uint64_t step) {
+  // kinetic, mass, mass * position, momentum and mass * position x velocity
+  using Sums = std::array<double, 11>;
+  std::vector<Sums> chunks(parallel_for_chunks(bodies.size()), Sums{});
+  parallel_for(bodies.size(), [&](size_t begin, size_t end, unsigned chunk) {
+    Sums sums{};
+    for (size_t i = begin; i < end; i++) {
+      const double m = bodies.mass[i];
+      const double x = bodies.x[i], y = bodies.y[i], z = bodies.z[i];
+      const double vx = bodies.vx[i], vy = bodies.vy[i], vz = bodies.vz[i];
+      sums[0] += m * (vx * vx + vy * vy + vz * vz) / 2;
+      sums[1] += m;
+      sums[2] += m * x;
+      sums[3] += m * y;
+      sums[4] += m * z;
+      sums[5] += m * vx;
+      sums[6] += m * vy;
+      sums[7] += m * vz;
+      sums[8] += m * (y * vz - z * vy);
+      sums[9] += m * (z * vx - x * vz);
+      sums[10] += m * (x * vy - y * vx);
+    }
+    chunks[chunk] = sums;
+  });
+  Sums sums{};
+  for (const Sums &chunk : chunks)
+    for (size_t s = 0; s < sums.size(); s++)
+      sums[s] += chunk[s];
+
+  Diagnostics diagnostics;
+  diagnostics.step = step;
+  diagnostics.kinetic = sums[0];
+  diagnostics.potential = potential;
+  diagnostics.momentum = {sums[5], sums[6], sums[7]};
+  // L around the centre of mass is L - (sum m r) x (sum m v) / M
+  const double mass = sums[1] > 0 ? sums[1] : 1;
+  const double *r = &sums[2], *p = &sums[5];
+  diagnostics.angular_momentum = {
+      sums[8] - (r[1] * p[2] - r[2] * p[1]) / mass,
+      sums[9] - (r[2] * p[0] - r[0] * p[2]) / mass,
+      sums[10] - (r[0] * p[1] - r[1] * p[0]) / mass};
+  return diagnostics;
+}
+
+// The energy errors are relative to G times the sum of m_i m_j over pairs,
+// the virial of this force law. A ln r potential has no natural zero, so the
+// total energy itself can be anywhere, even 0, while this is the size of the
+// kinetic energy of a system in equilibrium.
+inline double energy_scale(const Bodies &bodies, double gravitational_constant) {
+  double mass = 0, mass_squared = 0;
+  for (size_t i = 0; i < bodies.size(); i++) {
+    mass += bodies.mass[i];
+    mass_squared += bodies.mass[i] * bodies.mass[i];
+  }
+  return gravitational_constant * (mass * mass - mass_squared) / 2;
+}
+
+// A time series of diagnostics as CSV, a line per sample, flushed as it goes
+// so it can be followed while the simulation runs. The first sample is the
+// reference the energy error and the drift of the momenta are measured from.
+class DiagnosticsLog {
+public:
+  // Throws std::runtime_error.
+  DiagnosticsLog(const std::string &path, double energy_scale)
+      : file(std::fopen(path.c_str(), "w")), scale(energy_scale) {
+    if (!file)
+      throw std::runtime_error("can't write diagnostics " + path);
+    std::fputs("step,kinetic,potential,energy,energy_error,momentum_x,"
+               "momentum_y,momentum_z,angular_momentum_x,angular_momentum_y,"
+               "angular_momentum_z\n",
+               file);
+  }
+
+  ~DiagnosticsLog() { std::fclose(file); }
+
+  DiagnosticsLog(const DiagnosticsLog &) = delete;
+  DiagnosticsLog &operator=(const DiagnosticsLog &) = delete;
+
+  void write(const Diagnostics &diagnostics) {
+    if (samples++ == 0)
+      first = diagnostics;
+    latest = diagnostics;
+    const std::array<double, 3> &p = diagnostics.momentum;
+    const std::array<double, 3> &l = diagnostics.angular_momentum;
+    const std::string line = std::format(
+        "{},{:.17g},{:.17g},{:.17g},{:.6e},{:.17g},{:.17g},{:.17g},{:.17g},"
+        "{:.17g},{:.17g}\n",
+        diagnostics.step, diagnostics.kinetic, diagnostics.potential,
+        diagnostics.energy(), energy_error(), p[0], p[1], p[2], l[0], l[1],
+        l[2]);
+    std::fputs(line.c_str(), file);
+    std::fflush(file);
+  }
+
+  // Change of the total energy since the first sample, relative to the
+  // energy scale.
+  double energy_error() const {
+    return scale > 0 ? (latest.energy() - first.energy()) / scale : 0;
+  }
+
+  uint64_t sample_count() const { return samples; }
+
+private:
+  std::FILE *file;
+  double scale;
+  uint64_t samples = 0;
+  Diagnostics first, latest;
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "body.hpp"
+#include "checkpoint.hpp"
+#include "parallel.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Which bodies an output writes. A body's index is its id, bodies never
+// change order.
+struct OutputFilter {
+  enum class Kind {
+    all,
+    every,   // every k-th body by id
+    box,     // inside an axis aligned box
+    sphere,  // inside a sphere
+    top_mass // the m heaviest bodies
+  };
+  Kind kind = Kind::all;
+  size_t count = 1; // k of every, m of top_mass
+  std::array<double, 6> box{}; // lowest x, y, z then highest x, y, z
+  std::array<double, 4> sphere{}; // center x, y, z and radius
+};
+
+// Parse "all", "every:K", "box:X0,Y0,Z0,X1,Y1,Z1", "sphere:X,Y,Z,R" or
+// "top-mass:M". Throws std::invalid_argument.
+inline OutputFilter parse_output_filter(std::string_view text) {
+  const size_t colon = text.find(':');
+  const std::string_view kind = text.substr(0, colon);
+  std::vector<double> numbers;
+  if (colon != std::string_view::npos) {
+    const char *p = text.data() + colon + 1, *end = text.data() + text.size();
+    while (p < end) {
+      double number;
+      const auto [next, error] = std::from_chars(p, end, number);
+      if (error != std::errc() || (next < end && *next != ','))
+        throw std::invalid_argument("bad number in filter " +
+                                    std::string(text));
+      numbers.push_back(number);
+      p = next < end ? next + 1 : end;
+    }
+  }
+  const auto expect = [&](size_t count) {
+    if (numbers.size() != count)
+      throw std::invalid_argument("filter " + std::string(kind) + " takes " +
+                                  std::to_string(count) + " numbers");
+  };
+
+  OutputFilter filter;
+  if (kind == "all") {
+    expect(0);
+  } else if (kind == "every" || kind == "top-mass") {
+    expect(1);
+    if (numbers[0] < 1)
+      throw std::invalid_argument("filter " + std::string(kind) +
+                                  " needs a count of at least 1");
+    filter.kind = kind == "every" ? OutputFilter::Kind::every
+                                  : OutputFilter::Kind::top_mass;
+    filter.count = (size_t)numbers[0];
+  } else if (kind == "box") {
+    expect(6);
+    filter.kind = OutputFilter::Kind::box;
+    for (size_t axis = 0; axis < 3; axis++) {
+      filter.box[axis] = std::min(numbers[axis], numbers[axis + 3]);
+      filter.box[axis + 3] = std::max(numbers[axis], numbers[axis + 3]);
+    }
+  } else if (kind == "sphere") {
+    expect(4);
+    filter.kind = OutputFilter::Kind::sphere;
+    std::copy(numbers.begin(), numbers.end(), filter.sphere.begin());
+  } else {
+    throw std::invalid_argument("unknown filter " + std::string(text));
+  }
+  return filter;
+}
+
+// Set bit i % 64 of mask[i / 64] for every body i in words [first, last) of
+// the box or sphere. Compares 4 or 2 bodies at once where the compiler
+// targets SIMD and turns the lane results into bits with movemask.
+inline void region_mask(const Bodies &bodies, const OutputFilter &filter,
+                        uint64_t *mask, size_t first, size_t last) {
+  const size_t n = bodies.size();
+  const double *x = bodies.x.data(), *y = bodies.y.data(),
+               *z = bodies.z.data();
+  const bool box = filter.kind == OutputFilter::Kind::box;
+  const double radius_squared = filter.sphere[3] * filter.sphere[3];
+
+  for (size_t word = first; word < last; word++) {
+    const size_t begin = word * 64, end = std::min(n, begin + 64);
+    uint64_t bits = 0;
+    size_t i = begin;
+#if defined(__AVX__)
+    if (box) {
+      const __m256d low_x = _mm256_set1_pd(filter.box[0]),
+                    low_y = _mm256_set1_pd(filter.box[1]),
+                    low_z = _mm256_set1_pd(filter.box[2]),
+                    high_x = _mm256_set1_pd(filter.box[3]),
+                    high_y = _mm256_set1_pd(filter.box[4]),
+                    high_z = _mm256_set1_pd(filter.box[5]);
+      for (; i + 4 <= end; i += 4) {
+        const __m256d vx = _mm256_loadu_pd(x + i), vy = _mm256_loadu_pd(y + i),
+                      vz = _mm256_loadu_pd(z + i);
+        __m256d inside = _mm256_and_pd(_mm256_cmp_pd(vx, low_x, _CMP_GE_OQ),
+                                       _mm256_cmp_pd(vx, high_x, _CMP_LE_OQ));
+        inside = _mm256_and_pd(inside, _mm256_cmp_pd(vy, low_y, _CMP_GE_OQ));
+        inside = _mm256_and_pd(inside, _mm256_cmp_pd(vy, high_y, _CMP_LE_OQ));
+        inside = _mm256_and_pd(inside, _mm256_cmp_pd(vz, low_z, _CMP_GE_OQ));
+        inside = _mm256_and_pd(inside, _mm256_cmp_pd(vz, high_z, _CMP_LE_OQ));
+        bits |= (uint64_t)_mm256_movemask_pd(inside) << (i - begin);
+      }
+    } else {
+      const __m256d cx = _mm256_set1_pd(filter.sphere[0]),
+                    cy = _mm256_set1_pd(filter.sphere[1]),
+                    cz = _mm256_set1_pd(filter.sphere[2]),
+                    r2 = _mm256_set1_pd(radius_squared);
+      for (; i + 4 <= end; i += 4) {
+        const __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + i), cx),
+                      dy = _mm256_sub_pd(_mm256_loadu_pd(y + i), cy),
+                      dz = _mm256_sub_pd(_mm256_loadu_pd(z + i), cz);
+        const __m256d d2 = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+            _mm256_mul_pd(dz, dz));
+        bits |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(d2, r2, _CMP_LE_OQ))
+                << (i - begin);
+      }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    if (box) {
+      const __m128d low_x = _mm_set1_pd(filter.box[0]),
+                    low_y = _mm_set1_pd(filter.box[1]),
+                    low_z = _mm_set1_pd(filter.box[2]),
+                    high_x = _mm_set1_pd(filter.box[3]),
+                    high_y = _mm_set1_pd(filter.box[4]),
+                    high_z = _mm_set1_pd(filter.box[5]);
+      for (; i + 2 <= end; i += 2) {
+        const __m128d vx = _mm_loadu_pd(x + i), vy = _mm_loadu_pd(y + i),
+                      vz = _mm_loadu_pd(z + i);
+        __m128d inside =
+            _mm_and_pd(_mm_cmpge_pd(vx, low_x), _mm_cmple_pd(vx, high_x));
+        inside = _mm_and_pd(inside, _mm_cmpge_pd(vy, low_y));
+        inside = _mm_and_pd(inside, _mm_cmple_pd(vy, high_y));
+        inside = _mm_and_pd(inside, _mm_cmpge_pd(vz, low_z));
+        inside = _mm_and_pd(inside, _mm_cmple_pd(vz, high_z));
+        bits |= (uint64_t)_mm_movemask_pd(inside) << (i - begin);
+      }
+    } else {
+      const __m128d cx = _mm_set1_pd(filter.sphere[0]),
+                    cy = _mm_set1_pd(filter.sphere[1]),
+                    cz = _mm_set1_pd(filter.sphere[2]),
+                    r2 = _mm_set1_pd(radius_squared);
+      for (; i + 2 <= end; i += 2) {
+        const __m128d dx = _mm_sub_pd(_mm_loadu_pd(x + i), cx),
+                      dy = _mm_sub_pd(_mm_loadu_pd(y + i), cy),
+                      dz = _mm_sub_pd(_mm_loadu_pd(z + i), cz);
+        const __m128d d2 = _mm_add_pd(
+            _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+            _mm_mul_pd(dz, dz));
+        bits |= (uint64_t)_mm_movemask_pd(_mm_cmple_pd(d2, r2)) << (i - begin);
+      }
+    }
+#endif
+    for (; i < end; i++) {
+      bool inside;
+      if (box) {
+        inside = x[i] >= filter.box[0] && x[i] <= filter.box[3] &&
+                 y[i] >= filter.box[1] && y[i] <= filter.box[4] &&
+                 z[i] >= filter.box[2] && z[i] <= filter.box[5];
+      } else {
+        const double dx = x[i] - filter.sphere[0],
+                     dy = y[i] - filter.sphere[1],
+                     dz = z[i] - filter.sphere[2];
+        inside = dx * dx + dy * dy + dz * dz <= radius_squared;
+      }
+      bits |= (uint64_t)inside << (i - begin);
+    }
+    mask[word] = bits;
+  }
+}
+
+// Applies a filter to the bodies of every output step. The heaviest bodies
+// don't change as mass doesn't, so they are only picked once.
+class OutputSelector {
+public:
+  explicit OutputSelector(OutputFilter filter) : filter(filter) {}
+
+  const OutputFilter &output_filter() const { return filter; }
+
+  // Ids of the selected bodies, ascending.
+  const std::vector<uint64_t> &select(const Bodies &bodies) {
+    const size_t n = bodies.size();
+    switch (filter.kind) {
+    case OutputFilter::Kind::all:
+    case OutputFilter::Kind::every:
+      if (ids.size() != (n + filter.count - 1) / filter.count) {
+        ids.resize((n + filter.count - 1) / filter.count);
+        for (size_t i = 0; i < ids.size(); i++)
+          ids[i] = i * filter.count;
+      }
+      break;
+    case OutputFilter::Kind::top_mass:
+      if (ids.empty()) {
+        ids.resize(n);
+        for (size_t i = 0; i < n; i++)
+          ids[i] = i;
+        const size_t m = std::min(filter.count, n);
+        // heaviest first, ties to the lower id so the pick is stable
+        std::nth_element(ids.begin(), ids.begin() + m, ids.end(),
+                         [&](uint64_t a, uint64_t b) {
+                           return bodies.mass[a] > bodies.mass[b] ||
+                                  (bodies.mass[a] == bodies.mass[b] && a < b);
+                         });
+        ids.resize(m);
+        std::sort(ids.begin(), ids.end());
+      }
+      break;
+    case OutputFilter::Kind::box:
+    case OutputFilter::Kind::sphere:
+      select_region(bodies);
+      break;
+    }
+    return ids;
+  }
+
+  // Copy the selected bodies into selected, in id order. Returns their ids.
+  const std::vector<uint64_t> &gather(const Bodies &bodies, Bodies &selected) {
+    const std::vector<uint64_t> &chosen = select(bodies);
+    selected.resize(chosen.size());
+    const auto from = columns_of(bodies);
+    const auto into = columns_of(selected);
+    parallel_for(chosen.size(), [&](size_t begin, size_t end, unsigned) {
+      for (size_t c = 0; c < into.size(); c++) {
+        const double *values = from[c]->data();
+        double *out = into[c]->data();
+        for (size_t i = begin; i < end; i++)
+          out[i] = values[chosen[i]];
+      }
+    });
+    return chosen;
+  }
+
+private:
+  // Mask the bodies in parallel, count the selected bodies of every block of
+  // words, then turn each block's bits into ids at its offset.
+  void select_region(const Bodies &bodies) {
+    constexpr size_t words_per_block = 256; // 16384 bodies
+    const size_t n = bodies.size();
+    const size_t words = (n + 63) / 64;
+    const size_t blocks = (words + words_per_block - 1) / words_per_block;
+    mask.resize(words);
+    block_offsets.assign(blocks + 1, 0);
+
+    parallel_for(
+        blocks,
+        [&](size_t first_block, size_t last_block, unsigned) {
+          for (size_t block = first_block; block < last_block; block++) {
+            const size_t first = block * words_per_block;
+            const size_t last = std::min(words, first + words_per_block);
+            region_mask(bodies, filter, mask.data(), first, last);
+            size_t count = 0;
+            for (size_t word = first; word < last; word++)
+              count += std::popcount(mask[word]);
+            block_offsets[block + 1] = count;
+          }
+        },
+        1);
+    for (size_t block = 0; block < blocks; block++)
+      block_offsets[block + 1] += block_offsets[block];
+
+    ids.resize(block_offsets[blocks]);
+    parallel_for(
+        blocks,
+        [&](size_t first_block, size_t last_block, unsigned) {
+          for (size_t block = first_block; block < last_block; block++) {
+            size_t out = block_offsets[block];
+            const size_t first = block * words_per_block;
+            const size_t last = std::min(words, first + words_per_block);
+            for (size_t word = first; word < last; word++) {
+              for (uint64_t bits = mask[word]; bits != 0; bits &= bits - 1)
+                ids[out++] = word * 64 + std::countr_zero(bits);
+            }
+          }
+        },
+        1);
+  }
+
+  OutputFilter filter;
+  std::vector<uint64_t> ids;
+  std::vector<uint64_t> mask;
+  std::vector<size_t> block_offsets;
+};
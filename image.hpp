@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <numbers>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "parallel.hpp"
+#include "render.hpp"
+
+enum class Projection { orthographic, perspective };
+enum class ImageFormat { ppm, png };
+
+// Where the image is looked at from. Both projections look down the z axis at
+// the center of the bounds, which the update loop keeps at (0, 0, 0).
+struct Camera {
+  Projection projection = Projection::orthographic;
+  // Perspective only. Vertical field of view in degrees and how far the
+  // camera is from the center in multiples of the radius of the bounds.
+  double field_of_view = 60;
+  double distance = 2.5;
+};
+
+// An 8-bit RGB image, rows top to bottom.
+struct Image {
+  uint width = 0, height = 0;
+  TrackedVector<uint8_t, Subsystem::render> pixels; // width * height * 3
+};
+
+// Add up the count or mass of bodies into a width by height float
+// framebuffer as seen from the camera. Bodies behind a perspective camera are
+// left out.
+inline Histogram splat_bodies(const uint width, const uint height,
+                              const Bodies &bodies, const Bounds &bounds,
+                              const Camera &camera,
+                              const DensityWeight weight) {
+  const double lowest_x = bounds.lowest_x, highest_x = bounds.highest_x;
+  const double lowest_y = bounds.lowest_y, highest_y = bounds.highest_y;
+  const double lowest_z = bounds.lowest_z, highest_z = bounds.highest_z;
+  const double center_x = (lowest_x + highest_x) / 2;
+  const double center_y = (lowest_y + highest_y) / 2;
+  const double center_z = (lowest_z + highest_z) / 2;
+
+  // Keep the aspect ratio of the bodies by fitting the larger extent.
+  const double extent =
+      std::max({highest_x - lowest_x, highest_y - lowest_y, 1e-300});
+  const double pixels = std::min(width, height) - 1;
+
+  if (camera.projection == Projection::orthographic) {
+    const double scale = pixels / extent;
+    return accumulate_histogram(
+        height, width, bodies, weight, [&](size_t i, size_t &cell) {
+          const double x = (bodies.x[i] - center_x) * scale + width / 2.0;
+          const double y = (bodies.y[i] - center_y) * scale + height / 2.0;
+          if (!(x >= 0 && x < width && y >= 0 && y < height))
+            return false;
+          cell = (size_t)y * width + (size_t)x;
+          return true;
+        });
+  }
+
+  // Perspective: camera on the +z side of the bounds looking at the center.
+  const double radius =
+      std::max({highest_x - lowest_x, highest_y - lowest_y,
+                highest_z - lowest_z, 1e-300}) / 2;
+  const double camera_z = center_z + radius * camera.distance;
+  const double focal =
+      (height / 2.0) / std::tan(camera.field_of_view * std::numbers::pi / 360);
+  return accumulate_histogram(
+      height, width, bodies, weight, [&](size_t i, size_t &cell) {
+        const double depth = camera_z - bodies.z[i];
+        if (depth <= radius * 1e-3)
+          return false;
+        const double x =
+            (bodies.x[i] - center_x) * focal / depth + width / 2.0;
+        const double y =
+            (bodies.y[i] - center_y) * focal / depth + height / 2.0;
+        if (!(x >= 0 && x < width && y >= 0 && y < height))
+          return false;
+        cell = (size_t)y * width + (size_t)x;
+        return true;
+      });
+}
+
+// Turn a framebuffer into colours with log scaling, black for empty through
+// purple, red and orange to white for the densest pixel.
+inline Image tone_map(const uint width, const uint height,
+                      const Histogram &framebuffer) {
+  static constexpr std::array<std::array<double, 3>, 5> stops = {{
+      {0, 0, 0},
+      {60, 10, 120},
+      {210, 40, 40},
+      {255, 170, 0},
+      {255, 255, 255},
+  }};
+
+  const double highest = *std::max_element(framebuffer.begin(), framebuffer.end());
+  const double log_highest = std::log1p(highest);
+
+  Image image;
+  image.width = width;
+  image.height = height;
+  image.pixels.resize((size_t)width * height * 3);
+  parallel_for(framebuffer.size(), [&](size_t begin, size_t end, unsigned) {
+    for (size_t i = begin; i < end; i++) {
+      const double t =
+          log_highest > 0 ? std::log1p(framebuffer[i]) / log_highest : 0;
+      // lerp between the two stops t falls between
+      const double position = t * (stops.size() - 1);
+      const size_t stop = std::min<size_t>(stops.size() - 2, (size_t)position);
+      const double fraction = position - stop;
+      for (size_t c = 0; c < 3; c++) {
+        image.pixels[i * 3 + c] = (uint8_t)std::lround(
+            stops[stop][c] + (stops[stop + 1][c] - stops[stop][c]) * fraction);
+      }
+    }
+  });
+  return image;
+}
+
+// Binary PPM (P6). Any image viewer and ffmpeg reads it.
+inline std::string encode_ppm(const Image &image) {
+  std::string output =
+      std::format("P6\n{} {}\n255\n", image.width, image.height);
+  output.append((const char *)image.pixels.data(), image.pixels.size());
+  return output;
+}
+
+// CRC-32 as used by PNG chunks.
+inline uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// PNG without zlib. The image data is stored in uncompressed deflate blocks so
+// files are about as big as PPM but open everywhere PNG does.
+inline std::string encode_png(const Image &image) {
+  const auto put_u32 = [](std::string &output, uint32_t value) {
+    output += (char)(value >> 24);
+    output += (char)(value >> 16);
+    output += (char)(value >> 8);
+    output += (char)value;
+  };
+  const auto put_chunk = [&](std::string &output, const char *type,
+                             const std::string &data) {
+    put_u32(output, data.size());
+    const size_t start = output.size();
+    output.append(type, 4);
+    output += data;
+    put_u32(output, crc32((const uint8_t *)output.data() + start,
+                          output.size() - start));
+  };
+
+  // Every row starts with filter type 0 (none).
+  const size_t row_size = (size_t)image.width * 3;
+  std::string raw;
+  raw.reserve((row_size + 1) * image.height);
+  for (uint y = 0; y < image.height; y++) {
+    raw += '\0';
+    raw.append((const char *)image.pixels.data() + y * row_size, row_size);
+  }
+
+  // zlib stream of stored deflate blocks, at most 65535 bytes each.
+  std::string zlib = "\x78\x01";
+  for (size_t offset = 0; offset < raw.size() || offset == 0;) {
+    const size_t length = std::min<size_t>(65535, raw.size() - offset);
+    const bool last = offset + length == raw.size();
+    zlib += (char)(last ? 1 : 0);
+    zlib += (char)(length & 0xff);
+    zlib += (char)(length >> 8);
+    zlib += (char)(~length & 0xff);
+    zlib += (char)((~length >> 8) & 0xff);
+    zlib.append(raw, offset, length);
+    offset += length;
+    if (last)
+      break;
+  }
+  uint32_t a = 1, b = 0; // adler-32
+  for (unsigned char c : raw) {
+    a = (a + c) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_u32(zlib, (b << 16) | a);
+
+  std::string header;
+  put_u32(header, image.width);
+  put_u32(header, image.height);
+  header += "\x08\x02"; // 8 bits per channel, RGB
+  header += std::string(3, '\0'); // deflate, adaptive filtering, no interlace
+
+  std::string output = "\x89PNG\r\n\x1a\n";
+  put_chunk(output, "IHDR", header);
+  put_chunk(output, "IDAT", zlib);
+  put_chunk(output, "IEND", "");
+  return output;
+}
+
+// Writes numbered frames into a directory on background threads. write()
+// only queues the image so the update loop never waits for encoding or the
+// disk. If encoding falls behind, frames are dropped rather than queued
+// without end. Frames still queued when it is destroyed are finished first.
+class ImageSequenceWriter {
+public:
+  // Throws std::filesystem::filesystem_error if the directory can't be made.
+  ImageSequenceWriter(std::string directory, ImageFormat format,
+                      unsigned threads = 2)
+      : directory(std::move(directory)), format(format),
+        queue_limit(2 * std::max(1u, threads)), pool(threads) {
+    std::filesystem::create_directories(this->directory);
+  }
+
+  // False when dropped because too many frames are still being written.
+  bool write(uint frame, Image image) {
+    // one frame being encoded and one waiting per thread
+    if (pool.pending() >= queue_limit) {
+      dropped_frames++;
+      return false;
+    }
+    // shared so the task stays copyable for std::function
+    auto shared_image = std::make_shared<Image>(std::move(image));
+    pool.submit([this, frame, shared_image] {
+      const bool png = format == ImageFormat::png;
+      const std::string path = std::format("{}/frame_{:06}.{}", directory,
+                                           frame, png ? "png" : "ppm");
+      const std::string data =
+          png ? encode_png(*shared_image) : encode_ppm(*shared_image);
+      std::ofstream file(path, std::ios::binary);
+      file.write(data.data(), data.size());
+      if (!file)
+        failed_frames++;
+    });
+    return true;
+  }
+
+  // Frames that couldn't be written, e.g. the directory doesn't exist.
+  uint failures() const { return failed_frames; }
+  // Frames dropped because the writer was behind.
+  uint dropped() const { return dropped_frames; }
+
+private:
+  std::string directory;
+  ImageFormat format;
+  const size_t queue_limit;
+  std::atomic<uint> failed_frames = 0;
+  std::atomic<uint> dropped_frames = 0;
+  ThreadPool pool; // last so it finishes queued frames before anything else
+                   // is destroyed
+};
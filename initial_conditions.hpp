@@ -0,0 +1,412 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <vector>
+
+#include "body.hpp"
+#include "parallel.hpp"
+#include "random.hpp"
+
+// Make n bodies in parallel with make_body(random, i) returning body i. Every
+// body draws from its own RandomStream keyed by the seed and its index, so a
+// seed gives the same bodies for any number of threads.
+template <typename MakeBody>
+void generate_bodies(Bodies &bodies, size_t n, uint64_t seed,
+                     MakeBody make_body) {
+  bodies.resize(n);
+  parallel_for(n, [&](size_t begin, size_t end, unsigned) {
+    for (size_t i = begin; i < end; i++) {
+      RandomStream random(seed, i);
+      bodies.set(i, make_body(random, i));
+    }
+  });
+}
+
+// Bodies spread evenly in a cube from -n to n on every axis, scaled by the
+// number of bodies, with velocities and masses between 0 and 1.
+inline void generate_uniform_cube(Bodies &bodies, size_t n, uint64_t seed) {
+  generate_bodies(bodies, n, seed, [n](RandomStream &random, size_t) {
+    Body body;
+    // scale position of bodies by the number of bodies
+    body.x = random.uniform(-1, 1) * n;
+    body.y = random.uniform(-1, 1) * n;
+    body.z = random.uniform(-1, 1) * n;
+    body.vx = random.uniform();
+    body.vy = random.uniform();
+    body.vz = random.uniform();
+    body.mass = random.uniform();
+    return body;
+  });
+}
+
+enum class Model {
+  cube,    // the original uniform cube, unrelated masses and velocities
+  plummer, // Plummer sphere
+  king,    // King (1966) model with central potential king_w0
+  disk,    // exponential disk with a Hernquist bulge and halo
+  merger,  // two disk galaxies falling into each other
+  cold     // uniform sphere at rest that collapses
+};
+
+// Settings of the physical models. All bodies have the same mass.
+struct InitialConditions {
+  Model model = Model::cube;
+  double total_mass = 1;
+  // Plummer radius, King core radius, disk scale length or sphere radius.
+  double scale = 100;
+  // Kinetic over potential energy (K / |W|) the velocities are scaled to.
+  // 0.5 is equilibrium, 0 starts at rest.
+  double virial_ratio = 0.5;
+  double king_w0 = 6;
+  double gravitational_constant = 1;
+};
+
+// A direction uniformly on the unit sphere times length.
+inline void random_direction(RandomStream &random, double length, double &x,
+                             double &y, double &z) {
+  const double cos_theta = random.uniform(-1, 1);
+  const double sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+  const double phi = random.uniform(0, 2 * std::numbers::pi);
+  x = length * sin_theta * std::cos(phi);
+  y = length * sin_theta * std::sin(phi);
+  z = length * cos_theta;
+}
+
+// The force in the update loop (newton_law_of_universal_gravitation) falls
+// off as 1 / distance, so mass enclosed_mass pulls with G M / r and a
+// circular orbit needs v^2 = G M whatever its radius.
+inline double circular_speed_squared(double enclosed_mass, double G) {
+  return G * enclosed_mass;
+}
+
+// Move bodies[begin, end) so their center of mass is at (0, 0, 0) and at
+// rest. Sums in order so the result doesn't depend on the thread count.
+inline void remove_bulk_motion(Bodies &bodies, size_t begin, size_t end) {
+  double mass = 0, x = 0, y = 0, z = 0, vx = 0, vy = 0, vz = 0;
+  for (size_t i = begin; i < end; i++) {
+    mass += bodies.mass[i];
+    x += bodies.mass[i] * bodies.x[i];
+    y += bodies.mass[i] * bodies.y[i];
+    z += bodies.mass[i] * bodies.z[i];
+    vx += bodies.mass[i] * bodies.vx[i];
+    vy += bodies.mass[i] * bodies.vy[i];
+    vz += bodies.mass[i] * bodies.vz[i];
+  }
+  parallel_for(end - begin, [&](size_t first, size_t last, unsigned) {
+    for (size_t i = begin + first; i < begin + last; i++) {
+      bodies.x[i] -= x / mass;
+      bodies.y[i] -= y / mass;
+      bodies.z[i] -= z / mass;
+      bodies.vx[i] -= vx / mass;
+      bodies.vy[i] -= vy / mass;
+      bodies.vz[i] -= vz / mass;
+    }
+  });
+}
+
+// Scale the velocities of bodies[begin, end) so kinetic over potential
+// energy is virial_ratio. For the 1 / distance force the virial of a pair is
+// G m1 m2 whatever the distance, so |W| = G (M^2 - sum m^2) / 2 and this is
+// O(N) instead of a pass over all pairs.
+inline void virial_scale(Bodies &bodies, size_t begin, size_t end, double G,
+                         double virial_ratio) {
+  double mass = 0, mass_squared = 0, kinetic = 0;
+  for (size_t i = begin; i < end; i++) {
+    mass += bodies.mass[i];
+    mass_squared += bodies.mass[i] * bodies.mass[i];
+    kinetic += bodies.mass[i] *
+               (bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] +
+                bodies.vz[i] * bodies.vz[i]) /
+               2;
+  }
+  const double virial = G * (mass * mass - mass_squared) / 2;
+  const double factor =
+      kinetic > 0 ? std::sqrt(virial_ratio * virial / kinetic) : 0;
+  parallel_for(end - begin, [&](size_t first, size_t last, unsigned) {
+    for (size_t i = begin + first; i < begin + last; i++) {
+      bodies.vx[i] *= factor;
+      bodies.vy[i] *= factor;
+      bodies.vz[i] *= factor;
+    }
+  });
+}
+
+// Plummer sphere in units of its radius. Radii from the inverse of the
+// cumulative mass, cut at 10 radii, and speeds by rejection from the
+// distribution function (Aarseth, Henon & Wielen 1974).
+inline Body plummer_body(RandomStream &random, double mass) {
+  double r;
+  do {
+    r = 1 / std::sqrt(std::pow(random.uniform(1e-10, 1), -2.0 / 3) - 1);
+  } while (r > 10);
+
+  double q, g;
+  do {
+    q = random.uniform();
+    g = random.uniform(0, 0.1);
+  } while (g > q * q * std::pow(1 - q * q, 3.5));
+  const double speed = q * std::sqrt(2) * std::pow(1 + r * r, -0.25);
+
+  Body body;
+  body.mass = mass;
+  random_direction(random, r, body.x, body.y, body.z);
+  random_direction(random, speed, body.vx, body.vy, body.vz);
+  return body;
+}
+
+// King model solved once: radius against enclosed mass and dimensionless
+// potential W, in units of the core radius and velocity dispersion.
+struct KingProfile {
+  std::vector<double> radius, mass, potential;
+
+  explicit KingProfile(double w0) {
+    // density of the lowered isothermal sphere for potential w
+    const auto density = [](double w) {
+      if (w <= 0)
+        return 0.0;
+      return std::exp(w) * std::erf(std::sqrt(w)) -
+             std::sqrt(4 * w / std::numbers::pi) * (1 + 2 * w / 3);
+    };
+    const double central_density = density(w0);
+
+    // Integrate W'' = -9 rho / rho0 - 2 W' / r outward with RK4 until W
+    // reaches 0 at the tidal radius.
+    const double step = 1e-3;
+    double r = step, w = w0 - 1.5 * step * step, dw = -3 * step, m = 0;
+    radius = {0};
+    mass = {0};
+    potential = {w0};
+    const auto second = [&](double r, double w, double dw) {
+      return -9 * density(w) / central_density - 2 * dw / r;
+    };
+    while (w > 0 && r < 1e4) {
+      const double k1w = dw, k1d = second(r, w, dw);
+      const double k2w = dw + step / 2 * k1d,
+                   k2d = second(r + step / 2, w + step / 2 * k1w,
+                                dw + step / 2 * k1d);
+      const double k3w = dw + step / 2 * k2d,
+                   k3d = second(r + step / 2, w + step / 2 * k2w,
+                                dw + step / 2 * k2d);
+      const double k4w = dw + step * k3d,
+                   k4d = second(r + step, w + step * k3w, dw + step * k3d);
+      m += 4 * std::numbers::pi * r * r * density(w) / central_density * step;
+      w += step / 6 * (k1w + 2 * k2w + 2 * k3w + k4w);
+      dw += step / 6 * (k1d + 2 * k2d + 2 * k3d + k4d);
+      r += step;
+      radius.push_back(r);
+      mass.push_back(m);
+      potential.push_back(std::max(0.0, w));
+    }
+    for (double &enclosed : mass)
+      enclosed /= m;
+  }
+
+  // Radius and potential at fraction u of the mass.
+  void at_mass_fraction(double u, double &r, double &w) const {
+    const size_t i = std::min<size_t>(
+        mass.size() - 1,
+        std::max<size_t>(1, std::lower_bound(mass.begin(), mass.end(), u) -
+                                mass.begin()));
+    const double t =
+        mass[i] > mass[i - 1] ? (u - mass[i - 1]) / (mass[i] - mass[i - 1]) : 0;
+    r = radius[i - 1] + t * (radius[i] - radius[i - 1]);
+    w = potential[i - 1] + t * (potential[i] - potential[i - 1]);
+  }
+};
+
+inline Body king_body(RandomStream &random, const KingProfile &profile,
+                      double mass) {
+  double r, w;
+  profile.at_mass_fraction(random.uniform(), r, w);
+
+  // speed from f(v) ~ v^2 (exp(W - v^2 / 2) - 1) below the escape speed
+  const double escape = std::sqrt(2 * w);
+  const auto f = [w](double v) { return v * v * (std::exp(w - v * v / 2) - 1); };
+  double highest = 0;
+  for (int k = 1; k <= 32; k++)
+    highest = std::max(highest, f(escape * k / 32));
+  double speed = 0;
+  if (highest > 0) {
+    do {
+      speed = random.uniform(0, escape);
+    } while (random.uniform(0, highest * 1.1) > f(speed));
+  }
+
+  Body body;
+  body.mass = mass;
+  random_direction(random, r, body.x, body.y, body.z);
+  random_direction(random, speed, body.vx, body.vy, body.vz);
+  return body;
+}
+
+// Disk galaxy made of a Hernquist halo, a Hernquist bulge and an exponential
+// disk, in units of the disk scale length. Bodies are assigned to the parts
+// by index so every thread agrees on which is which.
+struct DiskGalaxy {
+  double halo_fraction = 0.7, bulge_fraction = 0.1; // the rest is disk
+  double halo_radius = 6, bulge_radius = 0.3, disk_height = 0.1;
+
+  // Mass inside radius r, counting the disk as if it was spherical.
+  double enclosed_mass(double r, double total) const {
+    const double disk_fraction = 1 - halo_fraction - bulge_fraction;
+    const auto hernquist = [r](double a) { return r * r / ((r + a) * (r + a)); };
+    return total * (halo_fraction * hernquist(halo_radius) +
+                    bulge_fraction * hernquist(bulge_radius) +
+                    disk_fraction * (1 - (1 + r) * std::exp(-r)));
+  }
+
+  // Body i of n in a galaxy of total mass total.
+  Body body(RandomStream &random, size_t i, size_t n, double total,
+            double G) const {
+    Body body;
+    body.mass = total / n;
+    const double part = (i + 0.5) / n;
+
+    if (part < halo_fraction + bulge_fraction) {
+      // Hernquist sphere by inverse cumulative mass, cut at 20 radii,
+      // isotropic with the local dispersion of an isothermal sphere.
+      const double a = part < halo_fraction ? halo_radius : bulge_radius;
+      double r;
+      do {
+        const double s = std::sqrt(random.uniform(1e-10, 1));
+        r = a * s / (1 - s);
+      } while (r > 20 * a);
+      const double sigma =
+          std::sqrt(circular_speed_squared(enclosed_mass(r, total), G) / 2);
+      random_direction(random, r, body.x, body.y, body.z);
+      body.vx = random.normal() * sigma;
+      body.vy = random.normal() * sigma;
+      body.vz = random.normal() * sigma;
+      return body;
+    }
+
+    // Exponential disk: the radius of an exponential surface density is
+    // gamma(2) distributed, heights follow sech^2. Rotates at the circular
+    // speed with a small dispersion.
+    const double R = -std::log(random.uniform(1e-10, 1) *
+                               random.uniform(1e-10, 1));
+    const double phi = random.uniform(0, 2 * std::numbers::pi);
+    const double z = disk_height * std::atanh(random.uniform(-0.999, 0.999));
+    const double speed =
+        std::sqrt(circular_speed_squared(enclosed_mass(R, total), G));
+    body.x = R * std::cos(phi);
+    body.y = R * std::sin(phi);
+    body.z = z;
+    body.vx = -speed * std::sin(phi) + random.normal() * speed * 0.1;
+    body.vy = speed * std::cos(phi) + random.normal() * speed * 0.1;
+    body.vz = random.normal() * speed * 0.05;
+    return body;
+  }
+};
+
+// Scale positions of bodies[begin, end) by scale.
+inline void scale_positions(Bodies &bodies, size_t begin, size_t end,
+                            double scale) {
+  parallel_for(end - begin, [&](size_t first, size_t last, unsigned) {
+    for (size_t i = begin + first; i < begin + last; i++) {
+      bodies.x[i] *= scale;
+      bodies.y[i] *= scale;
+      bodies.z[i] *= scale;
+    }
+  });
+}
+
+// Make n bodies of the model, at rest around (0, 0, 0) and scaled to the
+// virial ratio. The cube is left as it always was.
+inline void generate_model(Bodies &bodies, size_t n, uint64_t seed,
+                           const InitialConditions &ic) {
+  const double mass = ic.total_mass / n;
+  const double G = ic.gravitational_constant;
+
+  switch (ic.model) {
+  case Model::cube:
+    generate_uniform_cube(bodies, n, seed);
+    return;
+
+  case Model::plummer:
+    generate_bodies(bodies, n, seed, [&](RandomStream &random, size_t) {
+      return plummer_body(random, mass);
+    });
+    break;
+
+  case Model::king: {
+    const KingProfile profile(ic.king_w0);
+    generate_bodies(bodies, n, seed, [&](RandomStream &random, size_t) {
+      return king_body(random, profile, mass);
+    });
+    break;
+  }
+
+  case Model::cold:
+    // uniform in a sphere, random directions so virial_ratio > 0 still works
+    generate_bodies(bodies, n, seed, [&](RandomStream &random, size_t) {
+      Body body;
+      body.mass = mass;
+      random_direction(random, std::cbrt(random.uniform()), body.x, body.y,
+                       body.z);
+      random_direction(random, 1, body.vx, body.vy, body.vz);
+      return body;
+    });
+    break;
+
+  case Model::disk: {
+    const DiskGalaxy galaxy;
+    generate_bodies(bodies, n, seed, [&](RandomStream &random, size_t i) {
+      return galaxy.body(random, i, n, ic.total_mass, G);
+    });
+    break;
+  }
+
+  case Model::merger: {
+    // Two equal galaxies 20 scale lengths apart, the second one tilted, on a
+    // bound orbit at half the speed of a circular one so they merge within a
+    // few orbits.
+    const DiskGalaxy galaxy;
+    const size_t half = n / 2;
+    const double tilt = std::numbers::pi / 3;
+    generate_bodies(bodies, n, seed, [&](RandomStream &random, size_t i) {
+      const bool second = i >= half;
+      const size_t count = second ? n - half : half;
+      return galaxy.body(random, second ? i - half : i, count,
+                         ic.total_mass * count / n, G);
+    });
+    for (size_t part = 0; part < 2; part++) {
+      const size_t begin = part == 0 ? 0 : half, end = part == 0 ? half : n;
+      remove_bulk_motion(bodies, begin, end);
+      virial_scale(bodies, begin, end, G, ic.virial_ratio);
+    }
+
+    const double separation = 20;
+    const double orbit_speed =
+        0.5 * std::sqrt(circular_speed_squared(ic.total_mass, G));
+    parallel_for(n, [&](size_t begin, size_t end, unsigned) {
+      for (size_t i = begin; i < end; i++) {
+        const double side = i < half ? -0.5 : 0.5;
+        if (i >= half) {
+          // tilt the second galaxy about the x axis
+          const double y = bodies.y[i], z = bodies.z[i];
+          const double vy = bodies.vy[i], vz = bodies.vz[i];
+          bodies.y[i] = y * std::cos(tilt) - z * std::sin(tilt);
+          bodies.z[i] = y * std::sin(tilt) + z * std::cos(tilt);
+          bodies.vy[i] = vy * std::cos(tilt) - vz * std::sin(tilt);
+          bodies.vz[i] = vy * std::sin(tilt) + vz * std::cos(tilt);
+        }
+        bodies.x[i] += side * separation;
+        bodies.y[i] += side * separation * 0.25; // some impact parameter
+        bodies.vx[i] -= side * orbit_speed * 0.5;
+        bodies.vy[i] -= side * orbit_speed;
+      }
+    });
+    remove_bulk_motion(bodies, 0, n);
+    scale_positions(bodies, 0, n, ic.scale);
+    return;
+  }
+  }
+
+  remove_bulk_motion(bodies, 0, n);
+  virial_scale(bodies, 0, n, G, ic.virial_ratio);
+  scale_positions(bodies, 0, n, ic.scale);
+}
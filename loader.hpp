@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "body.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "quantize.hpp"
+
+enum class LoadFormat {
+  text,  // a line per body: x y z [vx vy vz [mass]]
+  binary,   // the x, y, z, vx, vy, vz and mass columns as raw doubles, one
+            // after the other
+  quantized // a lossy snapshot, see quantize.hpp
+};
+
+// Guess the format from the file extension. .bin and .raw are binary, .nbq
+// is quantized, everything else is text.
+inline LoadFormat load_format_of(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  const std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+  if (extension == ".nbq")
+    return LoadFormat::quantized;
+  return extension == ".bin" || extension == ".raw" ? LoadFormat::binary
+                                                    : LoadFormat::text;
+}
+
+// A line holds a body if its first character that isn't a space starts a
+// number. Blank lines, '#' comments and a header row like "x,y,z" aren't
+// bodies.
+inline bool is_body_line(const char *line, const char *line_end) {
+  while (line < line_end && (*line == ' ' || *line == '\t'))
+    line++;
+  return line < line_end &&
+         ((*line >= '0' && *line <= '9') || *line == '-' || *line == '+' ||
+          *line == '.');
+}
+
+inline const char *end_of_line(const char *line, const char *end) {
+  const char *newline = (const char *)std::memchr(line, '\n', end - line);
+  return newline ? newline : end;
+}
+
+// Load bodies from text where every body is a line of numbers separated by
+// spaces, tabs, commas or semicolons: position, then optionally velocity and
+// mass. Missing velocities are 0 and a missing mass is 1. The file is memory
+// mapped and cut into pieces at line breaks, the pieces count their bodies in
+// parallel and then parse straight into the columns with std::from_chars, also
+// in parallel, so nothing is copied through a stream.
+inline void load_text_bodies(const std::string &path, Bodies &bodies) {
+  const MappedFile file(path);
+  const char *const text = (const char *)file.data();
+  const char *const text_end = text + file.size();
+
+  // Pieces of about 4 MiB, every piece but the first starts after a newline.
+  const size_t piece_size = 4 << 20;
+  std::vector<const char *> piece_starts = {text};
+  for (size_t offset = piece_size; offset < file.size(); offset += piece_size) {
+    const char *start = end_of_line(text + offset, text_end);
+    if (start < text_end)
+      start++;
+    if (start > piece_starts.back() && start < text_end)
+      piece_starts.push_back(start);
+  }
+  const size_t pieces = piece_starts.size();
+  piece_starts.push_back(text_end);
+
+  // First pass counts the bodies of every piece so the second pass knows
+  // where each piece's bodies go.
+  std::vector<size_t> piece_bodies(pieces + 1, 0);
+  parallel_for(
+      pieces,
+      [&](size_t begin, size_t end, unsigned) {
+        for (size_t piece = begin; piece < end; piece++) {
+          size_t count = 0;
+          for (const char *line = piece_starts[piece];
+               line < piece_starts[piece + 1];) {
+            const char *line_end = end_of_line(line, piece_starts[piece + 1]);
+            count += is_body_line(line, line_end);
+            line = line_end + 1;
+          }
+          piece_bodies[piece + 1] = count;
+        }
+      },
+      1);
+  for (size_t piece = 0; piece < pieces; piece++)
+    piece_bodies[piece + 1] += piece_bodies[piece];
+
+  bodies.resize(piece_bodies[pieces]);
+  std::array<Column *, 7> columns = {&bodies.x,  &bodies.y,  &bodies.z,
+                                     &bodies.vx, &bodies.vy, &bodies.vz,
+                                     &bodies.mass};
+
+  parallel_for(
+      pieces,
+      [&](size_t begin, size_t end, unsigned) {
+        for (size_t piece = begin; piece < end; piece++) {
+          size_t i = piece_bodies[piece];
+          for (const char *line = piece_starts[piece];
+               line < piece_starts[piece + 1];) {
+            const char *line_end = end_of_line(line, piece_starts[piece + 1]);
+            if (!is_body_line(line, line_end)) {
+              line = line_end + 1;
+              continue;
+            }
+
+            std::array<double, 7> values = {0, 0, 0, 0, 0, 0, 1};
+            size_t count = 0;
+            const char *p = line;
+            while (true) {
+              while (p < line_end && (*p == ' ' || *p == '\t' || *p == ',' ||
+                                      *p == ';' || *p == '\r'))
+                p++;
+              if (p == line_end || count == values.size())
+                break;
+              // from_chars doesn't take a leading '+'
+              if (*p == '+')
+                p++;
+              const auto [next, error] = std::from_chars(p, line_end, values[count]);
+              if (error != std::errc())
+                throw std::runtime_error(
+                    path + ": bad number at byte " + std::to_string(p - text));
+              p = next;
+              count++;
+            }
+            if (count < 3)
+              throw std::runtime_error(path + ": body at byte " +
+                                       std::to_string(line - text) +
+                                       " has no full position");
+
+            for (size_t c = 0; c < columns.size(); c++)
+              (*columns[c])[i] = values[c];
+            i++;
+            line = line_end + 1;
+          }
+        }
+      },
+      1);
+}
+
+// Load bodies from raw binary columns of doubles in the native byte order:
+// all x, then all y, z, vx, vy, vz and mass, so the body count is the file
+// size divided by 56. The columns become views of a private memory mapping,
+// nothing is copied and pages are read as they are first used.
+inline void load_binary_bodies(const std::string &path, Bodies &bodies) {
+  auto file = std::make_shared<MappedFile>(path,
+                                           MappedFile::Access::private_copy);
+  constexpr size_t columns = 7;
+  if (file->size() % (columns * sizeof(double)) != 0)
+    throw std::runtime_error(path + " isn't 7 columns of doubles");
+  const size_t n = file->size() / (columns * sizeof(double));
+
+  std::array<Column *, columns> body_columns = {
+      &bodies.x, &bodies.y, &bodies.z, &bodies.vx, &bodies.vy, &bodies.vz,
+      &bodies.mass};
+  for (size_t c = 0; c < columns; c++)
+    *body_columns[c] =
+        Column::view((double *)file->data() + c * n, n, file);
+}
+
+// Load a quantized snapshot. Decoding writes every value, so unlike the raw
+// columns this is a copy out of the mapping.
+inline void load_quantized_bodies(const std::string &path, Bodies &bodies) {
+  const MappedFile file(path);
+  try {
+    decode_quantized(file.data(), file.size(), bodies);
+  } catch (const std::runtime_error &error) {
+    throw std::runtime_error(path + ": " + error.what());
+  }
+}
+
+inline void load_bodies(const std::string &path, LoadFormat format,
+                        Bodies &bodies) {
+  if (format == LoadFormat::binary)
+    load_binary_bodies(path, bodies);
+  else if (format == LoadFormat::quantized)
+    load_quantized_bodies(path, bodies);
+  else
+    load_text_bodies(path, bodies);
+}
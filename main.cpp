@@ -1,13 +1,36 @@
 #include <array>
 #include <chrono>
 #include <cmath>
+#include <csignal>
 #include <cstdlib>
 #include <format>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
-#include <vector>
 
-typedef unsigned int uint;
+#include "body.hpp"
+#include "bounds.hpp"
+#include "camera.hpp"
+#include "checkpoint.hpp"
+#include "console.hpp"
+#include "diagnostics.hpp"
+#include "image.hpp"
+#include "initial_conditions.hpp"
+#include "loader.hpp"
+#include "memory.hpp"
+#include "metrics.hpp"
+#include "options.hpp"
+#include "parallel.hpp"
+#include "physics.hpp"
+#include "player.hpp"
+#include "render.hpp"
+#include "shared_memory.hpp"
+#include "snapshot.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+#include "trajectory.hpp"
+#include "video.hpp"
 
 // https://stackoverflow.com/a/62485211/17921095
 #if defined(_WIN32)
@@ -27,144 +50,384 @@ void get_terminal_size(int &width, int &height) {
   width = (int)(csbi.srWindow.Right - csbi.srWindow.Left + 1);
   height = (int)(csbi.srWindow.Bottom - csbi.srWindow.Top + 1);
 #elif defined(__linux__) || defined(__APPLE__)
-  struct winsize w;
-  ioctl(fileno(stdout), TIOCGWINSZ, &w);
+  struct winsize w {};
+  // not a terminal, e.g. redirected to a file: use the classic 80x24
+  if (ioctl(fileno(stdout), TIOCGWINSZ, &w) != 0 || w.ws_col == 0 ||
+      w.ws_row == 0) {
+    w.ws_col = 80;
+    w.ws_row = 24;
+  }
   width = (int)(w.ws_col);
   height = (int)(w.ws_row);
 #endif // Windows/Linux
 }
 
-// https://stackoverflow.com/a/52895729/17921095
-void clear_console() {
-#if defined _WIN32
-  system("cls");
-  // clrscr(); // including header file : conio.h
-#elif defined(__LINUX__) || defined(__gnu_linux__) || defined(__linux__)
-  system("clear");
-  // std::cout<< u8"\033[2J\033[1;1H"; //Using ANSI Escape Sequences
-#elif defined(__APPLE__)
-  system("clear");
-#endif
+// Set by Ctrl+C or SIGTERM to leave the loop after the current update, so the
+// writers finish and everything is cleaned up on the way out of main.
+volatile std::sig_atomic_t stop_requested = 0;
+void request_stop(int) { stop_requested = 1; }
+
+// Set by SIGUSR1 to write the trace so far after the current update.
+volatile std::sig_atomic_t trace_requested = 0;
+void request_trace(int) { trace_requested = 1; }
+
+// Write the trace if tracing, reporting rather than stopping on failure.
+void write_trace(const Options &options) {
+  if (options.trace_path.empty())
+    return;
+  try {
+    tracer().write(options.trace_path);
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << '\n';
+  }
 }
 
-double newton_law_of_universal_gravitation(
-    double gravitational_constant, double mass1, double mass2,
-    double distance_between_the_two_mass_centers) {
-  return gravitational_constant *
-         ((mass1 * mass2) / distance_between_the_two_mass_centers);
+// Play a stored trajectory or checkpoint back through the same renderers as
+// the simulation instead of simulating. Ends at either end of the run.
+int replay(const Options &options, const uint updates_per_second) {
+  std::unique_ptr<Player> player;
+  try {
+    player = std::make_unique<Player>(options.replay_path);
+    player->seek(options.replay_start);
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << '\n';
+    return 1;
+  }
+
+  MapCamera map_camera = options.map_camera;
+  std::unique_ptr<ImageSequenceWriter> image_writer;
+  if (!options.image_directory.empty()) {
+    try {
+      image_writer = std::make_unique<ImageSequenceWriter>(
+          options.image_directory, options.image_format);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
+  std::unique_ptr<VideoStream> video;
+  if (!options.video_path.empty()) {
+    try {
+      video = std::make_unique<VideoStream>(
+          options.video_path, options.video_format, options.image_width,
+          options.image_height, updates_per_second);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
+  std::unique_ptr<ConsoleOutput> console;
+  if (options.video_path != "-")
+    console = std::make_unique<ConsoleOutput>();
+
+  uint frame = 0;
+  std::chrono::time_point last_time = std::chrono::high_resolution_clock::now();
+  while (!stop_requested) {
+    std::chrono::time_point now_time =
+        std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> time_delta = now_time - last_time;
+    if (time_delta.count() < 1 / (double)updates_per_second)
+      continue;
+    last_time = now_time;
+
+    const Bodies &bodies = player->bodies();
+    const Bounds view = map_camera.view(bodies, compute_bounds(bodies));
+    if (console) {
+      int height, width;
+      get_terminal_size(width, height);
+      std::string map =
+          options.render_mode == RenderMode::map
+              ? create_map_of_bodies(height, width, bodies, view)
+              : create_density_map_of_bodies(
+                    height, width, bodies, view, options.density_weight,
+                    options.render_mode == RenderMode::density_colour);
+      console->submit(std::move(map),
+                      '\r' + std::to_string(player->step()) + " (" +
+                          std::to_string((size_t)player->position() + 1) + '/' +
+                          std::to_string(player->frames()) + ")");
+    }
+    if (image_writer || (video && !video->failed())) {
+      Image image =
+          tone_map(options.image_width, options.image_height,
+                   splat_bodies(options.image_width, options.image_height,
+                                bodies, view, options.camera,
+                                options.density_weight));
+      if (video && !video->failed())
+        video->write(image);
+      if (image_writer)
+        image_writer->write(frame, std::move(image));
+    }
+    frame++;
+
+    // a damaged chunk stops the replay rather than the program
+    const double position = player->position();
+    try {
+      player->advance(options.replay_speed);
+    } catch (const std::exception &error) {
+      console.reset();
+      std::cerr << '\n' << error.what() << '\n';
+      return 1;
+    }
+    if (player->position() == position)
+      break;
+  }
+  return 0;
 }
 
-double magnitude(double x, double y, double z) {
-  return sqrt(x * x + y * y + z * z);
+// Bytes the solver and outputs allocate on top of the bodies while stepping,
+// roughly and at most, for the memory budget.
+uint64_t memory_for_stepping(const Options &options, size_t n,
+                             size_t trajectory_chunk) {
+  const uint64_t body_bytes = (uint64_t)n * 7 * sizeof(double);
+  uint64_t bytes = 0;
+  if (options.solver == Solver::parallel &&
+      options.precision != Precision::full)
+    bytes += (uint64_t)n * 4 * sizeof(float); // positions and masses as float
+  if (!options.checkpoint_path.empty())
+    bytes += body_bytes; // the copy being written
+  if (!options.trajectory_path.empty())
+    // two chunks in flight and the shuffled and compressed columns of one
+    bytes += 4 * (uint64_t)trajectory_chunk * n * 6 * sizeof(double);
+  if (!options.snapshot_directory.empty())
+    bytes += 2 * body_bytes; // the copy and its encoding
+  if (!options.shm_name.empty())
+    bytes += options.shm_slots * body_bytes;
+  if (!options.image_directory.empty() || !options.video_path.empty()) {
+    // a framebuffer per thread, and a few images queued and being encoded
+    const uint64_t pixels = (uint64_t)options.image_width * options.image_height;
+    bytes += pixels * sizeof(double) * thread_count() + pixels * 3 * 8;
+  }
+  return bytes;
 }
 
-double distance(double x1, double y1, double z1, double x2, double y2,
-                double z2) {
-  // We get the difference of the two points. Distance is just the magnitude of
-  // the difference a point to a other point
-  double x = (x1 - x2);
-  double y = (y1 - y2);
-  double z = (z1 - z2);
+int main(int argc, char **argv) {
+  // nothing mixes C stdio and iostreams, and the console has its own writer
+  std::ios::sync_with_stdio(false);
+  Options options;
+  try {
+    options = parse_options(argc, argv);
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << '\n' << usage();
+    return 1;
+  }
+  set_thread_count(options.threads);
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
 
-  // Get the magnitude of difference
-  return magnitude(x, y, z);
-}
+  const uint updates_per_second = 10;
+  if (!options.replay_path.empty())
+    return replay(options, updates_per_second);
+
+  // Start tracing before any background thread so they are all named.
+  if (!options.trace_path.empty()) {
+    tracer().start();
+#if defined(SIGUSR1)
+    std::signal(SIGUSR1, request_trace);
+#endif
+  }
+
+  SimulationState state;
+  Bodies bodies;
+
+  if (!options.restart_path.empty()) {
+    // Carry on where a checkpoint left off. The bodies are mapped, not read.
+    try {
+      load_checkpoint(options.restart_path, bodies, state);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  } else if (!options.load_path.empty()) {
+    // Initial conditions from a catalogue, straight into the columns.
+    try {
+      load_bodies(options.load_path, options.load_format, bodies);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+    if (bodies.size() < 2) {
+      std::cerr << options.load_path << " has less than 2 bodies\n";
+      return 1;
+    }
+  } else {
+    // Init bodies. The same seed gives the same bodies on any machine and
+    // with any number of threads.
+    InitialConditions initial_conditions = options.initial_conditions;
+    initial_conditions.gravitational_constant = state.gravitational_constant;
+    generate_model(bodies, options.number_of_bodies, options.seed,
+                   initial_conditions);
+  }
+  const uint number_of_bodies = bodies.size();
+  const double gravitational_constant = state.gravitational_constant;
+
+  // Chunks of the trajectory hold up to 64 steps and about 256 MiB before
+  // compression.
+  const uint chunk =
+      options.trajectory_chunk != 0
+          ? options.trajectory_chunk
+          : std::clamp<size_t>((256u << 20) / (number_of_bodies * 48), 1, 64);
+
+  // Stop before any output is opened if the run would go over the memory
+  // budget: what is resident now, bodies mapped from a checkpoint or
+  // catalogue that aren't yet and are copied when written, and what stepping
+  // will allocate.
+  if (options.memory_budget > 0) {
+    const uint64_t resident = resident_memory().bytes;
+    uint64_t mapped = 0;
+    for (const Column *column : columns_of(bodies))
+      if (column->is_view())
+        mapped += column->size() * sizeof(double);
+    const uint64_t stepping =
+        memory_for_stepping(options, number_of_bodies, chunk);
+    if (resident + mapped + stepping > options.memory_budget) {
+      std::cerr << std::format(
+          "needs about {} ({} now, {} for stepping), over the memory budget "
+          "of {}\n",
+          format_bytes((double)(resident + mapped + stepping)),
+          format_bytes((double)(resident + mapped)),
+          format_bytes((double)stepping),
+          format_bytes((double)options.memory_budget));
+      return 1;
+    }
+  }
 
-struct Body {
-  double x, y, z;    // position of the mass centers will be the body
-  double vx, vy, vz; // velocity
-  double mass;
+  // Bounds of the bodies, updated once per update by a single sweep and
+  // shared by everything that needs them.
+  Bounds bounds = compute_bounds(bodies);
+  // What area the map and images show out of those bounds.
+  MapCamera map_camera = options.map_camera;
+
+  // Images are encoded and written on background threads.
+  std::unique_ptr<ImageSequenceWriter> image_writer;
+  if (!options.image_directory.empty()) {
+    try {
+      image_writer = std::make_unique<ImageSequenceWriter>(
+          options.image_directory, options.image_format);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
 
-  std::string to_string() const {
-    return std::format("position: {}, {}, {} | velocity: {}, {}, {} | mass: {}",
-                       x, y, z, vx, vy, vz, mass);
+  // Video frames are streamed to a pipe by a writer thread. The console can't
+  // show the map when the video goes to stdout.
+  std::unique_ptr<VideoStream> video;
+  if (!options.video_path.empty()) {
+    try {
+      video = std::make_unique<VideoStream>(
+          options.video_path, options.video_format, options.image_width,
+          options.image_height,
+          std::max(1u, updates_per_second / options.video_every));
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
   }
-};
-
-// Create a string of a map of the bodies relative to each other.
-// Need more than two bodies to be useful
-// Comment out z cause only x and y is accounted for now.
-template <size_t size>
-std::string create_map_of_bodies(const uint height, const uint width,
-                                 const std::array<Body, size> &bodies) {
-  // Get the bounds of the area that the bodies are in.
-  double highest_x, highest_y, highest_z;
-  double lowest_x, lowest_y, lowest_z;
-  highest_x = highest_y = highest_z = std::numeric_limits<double>::min();
-  lowest_x = lowest_y = lowest_z = std::numeric_limits<double>::max();
-  for (Body const &body : bodies) {
-    if (body.x > highest_x)
-      highest_x = body.x;
-    if (body.y > highest_y)
-      highest_y = body.y;
-    if (body.z > highest_z)
-      highest_z = body.z;
-    if (body.x < lowest_x)
-      lowest_x = body.x;
-    if (body.y < lowest_y)
-      lowest_y = body.y;
-    if (body.z < lowest_z)
-      lowest_z = body.z;
+  // The map and update count are written to the console by a writer thread.
+  // The console can't show them when the video goes to stdout.
+  std::unique_ptr<ConsoleOutput> console;
+  if (options.video_path != "-")
+    console = std::make_unique<ConsoleOutput>();
+
+  // Checkpoints are written on a background thread from a copy of the bodies.
+  std::unique_ptr<CheckpointWriter> checkpoint_writer;
+  if (!options.checkpoint_path.empty())
+    checkpoint_writer =
+        std::make_unique<CheckpointWriter>(options.checkpoint_path);
+
+  // Trajectory steps are compressed and written on a background thread.
+  std::unique_ptr<TrajectoryWriter> trajectory_writer;
+  if (!options.trajectory_path.empty()) {
+    try {
+      trajectory_writer = std::make_unique<TrajectoryWriter>(
+          options.trajectory_path, bodies, state, options.trajectory_codec,
+          chunk, options.trajectory_every);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
   }
 
-  // set the characters to be used to represent the z position of bodies.
-  // the lowest z position will have the smallest character and the highest z
-  // positon will have the biggest character.
-  std::array z_characters = {'.', '\'', ':', '-', '_', '^', '+', '=',
-                             '~', '*',  'o', 'O', '#', '%', '&', '@'};
-  uint z_size = z_characters.size();
-
-  std::vector<std::string> lines{height, std::string(width, ' ')};
-  for (Body const &body : bodies) {
-    // get map index positon of body by inverse lerp using bounds
-    const uint x =
-        round((body.x - lowest_x) / (highest_x - lowest_x) * (width - 1));
-    const uint y =
-        round((body.y - lowest_y) / (highest_y - lowest_y) * (height - 1));
-    const uint z =
-        round((body.z - lowest_z) / (highest_z - lowest_z) * (z_size - 1));
-
-    lines[y][x] = z_characters[z];
+  // Snapshots are filtered on this thread and written on a background one.
+  std::unique_ptr<SnapshotWriter> snapshot_writer;
+  if (!options.snapshot_directory.empty()) {
+    try {
+      snapshot_writer = std::make_unique<SnapshotWriter>(
+          options.snapshot_directory, options.snapshot_filter,
+          options.snapshot_error);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
   }
 
-  std::string output = "";
-  // append all lines to output
-  for (std::string const &line : lines) {
-    output += line + '\n';
+  // Snapshots for other processes are published to shared memory every
+  // update.
+  std::unique_ptr<SnapshotPublisher> snapshot_publisher;
+  if (!options.shm_name.empty()) {
+    try {
+      snapshot_publisher = std::make_unique<SnapshotPublisher>(
+          options.shm_name, number_of_bodies, options.shm_slots,
+          gravitational_constant);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
   }
 
-  return output;
-}
+  // Energy, momentum and angular momentum every few updates. The potential
+  // energy comes out of the force loop on those updates.
+  std::unique_ptr<DiagnosticsLog> diagnostics_log;
+  if (!options.diagnostics_path.empty()) {
+    try {
+      diagnostics_log = std::make_unique<DiagnosticsLog>(
+          options.diagnostics_path,
+          energy_scale(bodies, gravitational_constant));
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
 
-int main() {
-  const uint number_of_bodies = 1000;
-  const double gravitational_constant = 1;
-  const uint updates_per_second = 10;
-  std::array<Body, number_of_bodies> bodies{};
-
-  // Set random seed for rand function
-  srand(time(NULL));
-
-  // Init bodies
-  for (Body &body : bodies) {
-    const auto rand01double = []() { return (double)(rand()) / RAND_MAX; };
-    const auto randn1to1double = [&]() { return rand01double()*2-1; };
-    const auto randndouble = [&]() { return randn1to1double() * number_of_bodies; };
-
-    // scale position of bodies by the number of bodies
-    body.x = randndouble();
-    body.y = randndouble();
-    body.z = randndouble();
-    body.vx = rand01double();
-    body.vy = rand01double();
-    body.vz = rand01double();
-    body.mass = rand01double();
+  // Numbers for monitoring, stored by the update loop and exported by a
+  // background thread.
+  Metrics metrics;
+  metrics.bodies = number_of_bodies;
+  std::unique_ptr<MetricsExporter> metrics_exporter;
+  if (!options.metrics_target.empty()) {
+    try {
+      metrics_exporter = std::make_unique<MetricsExporter>(
+          options.metrics_target, options.metrics_interval, metrics);
+    } catch (const std::exception &error) {
+      std::cerr << error.what() << '\n';
+      return 1;
+    }
+  }
+  const double interactions =
+      interactions_per_update(number_of_bodies, options.solver);
+
+  // Time every phase of the updates, shown next to the update count every
+  // second and as a report at the end.
+  PhaseTimers timers;
+  std::string timing_summary;
+
+  // Hardware counters per phase. Opened after the background writers are
+  // started so only the update loop and its workers are counted.
+  std::unique_ptr<PerfCounters> counters;
+  if (options.perf_counters && timers_enabled) {
+    counters = std::make_unique<PerfCounters>();
+    if (!counters->problem().empty())
+      std::cerr << "performance counters: " << counters->problem() << '\n';
+    if (counters->available())
+      timers.attach(*counters);
   }
 
   // Update loop
-  uint updateCount = 0;
+  uint updateCount = state.update_count;
+  const uint first_update = updateCount;
   std::chrono::time_point last_time = std::chrono::high_resolution_clock::now();
-  while (true) {
+  while (!stop_requested &&
+         (options.updates == 0 || updateCount - first_update < options.updates)) {
     std::chrono::time_point now_time =
         std::chrono::high_resolution_clock::now();
     // Calculate time difference from the last update and now in seconds
@@ -178,118 +441,167 @@ int main() {
     if (time_delta.count() < seconds_to_update)
       continue;
     last_time = now_time; // Set this as the last update
+    TraceScope update_trace("update");
 
-    // Clear all text in console. Avoid cluttering the console.
-    clear_console();
+    if (trace_requested) {
+      trace_requested = 0;
+      write_trace(options);
+    }
 
-    // Print map to console.
+    // Draw the map for the console.
+    std::string map;
     {
-      // set map height and width by the terminal height and width every update
-      int height, width;
-      get_terminal_size(width, height);
-      std::cout << create_map_of_bodies(
-          height, width, bodies); // implicit int to uint conversion
+      const Bounds view = map_camera.view(bodies, bounds);
+      if (console) {
+        ScopedTimer timer(timers, Phase::map);
+        // set map height and width by the terminal height and width every
+        // update
+        int height, width;
+        get_terminal_size(width, height);
+        // implicit int to uint conversion
+        if (options.render_mode == RenderMode::map)
+          map = create_map_of_bodies(height, width, bodies, view);
+        else
+          map = create_density_map_of_bodies(
+              height, width, bodies, view, options.density_weight,
+              options.render_mode == RenderMode::density_colour);
+      }
+
+      // Render the same positions as an image and video frame if asked to.
+      const bool video_frame =
+          video && !video->failed() && updateCount % options.video_every == 0;
+      if (image_writer || video_frame) {
+        ScopedTimer timer(timers, Phase::render);
+        Image image =
+            tone_map(options.image_width, options.image_height,
+                     splat_bodies(options.image_width, options.image_height,
+                                  bodies, view, options.camera,
+                                  options.density_weight));
+        if (video_frame)
+          video->write(image);
+        if (image_writer)
+          image_writer->write(updateCount, std::move(image));
+      }
 
       // Update the position of the bodies by their velocity.
-      for (Body &body : bodies) {
-        body.x += body.vx;
-        body.y += body.vy;
-        body.z += body.vz;
+      {
+        ScopedTimer timer(timers, Phase::drift);
+        drift(bodies);
       }
+      ScopedTimer timer(timers, Phase::bounds);
+      bounds = compute_bounds(bodies);
     }
 
-    // Print the update count at the start of the last line. Use '\r' to write
-    // at the start of last line
-    std::cout << '\r' << updateCount;
+    // Hand the map and the update count to the console writer, which clears
+    // the screen and writes them. Put the update count at the start of the
+    // last line with '\r', followed by how long the phases took over the last
+    // second. Dropped if the console is still busy.
+    if (console) {
+      if (timers_enabled && updateCount % updates_per_second == 0)
+        timing_summary = "  " + timers.summary();
+      ScopedTimer timer(timers, Phase::console);
+      std::string status = '\r' + std::to_string(updateCount) + timing_summary;
+      if (diagnostics_log && diagnostics_log->sample_count() > 0)
+        status += std::format("  energy error {:.2e}",
+                              diagnostics_log->energy_error());
+      console->submit(std::move(map), std::move(status));
+    }
 
     // Update the velocity of the bodies by acceleration using newton's law of
-    // universal gravitation.
+    // universal gravitation. On diagnostics updates the potential energy is
+    // added up on the way.
+    const bool sample_diagnostics =
+        diagnostics_log &&
+        (updateCount + 1) % options.diagnostics_every == 0;
+    double potential;
     {
-      // copy bodies to use their unmodified positions to not have acceleration
-      // calculations depend on the order of bodies in the array
-      const std::array<Body, number_of_bodies> bodies_old = bodies;
-
-      // Avoid bodies that already have calculations for each other by looping
-      // all combinations. Each calculation will update both bodies at the same
-      // time to not repeat the same calculations twice.
-      for (uint i1 = 0, n = bodies.size(); i1 < n - 1; i1++) {
-        for (uint i2 = i1 + 1; i2 < n; i2++) {
-
-          // the mass centers will be the bodies' x, y, z members
-          const double distance_between_the_two_mass_centers =
-              distance(bodies_old[i1].x, bodies_old[i1].y, bodies_old[i1].z,
-                       bodies_old[i2].x, bodies_old[i2].y, bodies_old[i2].z);
-
-          const double force = newton_law_of_universal_gravitation(
-              gravitational_constant, bodies_old[i1].mass, bodies_old[i2].mass,
-              distance_between_the_two_mass_centers);
-
-          // Get the direction of the force for the first body
-          const double x1 = (bodies_old[i2].x - bodies_old[i1].x);
-          const double y1 = (bodies_old[i2].y - bodies_old[i1].y);
-          const double z1 = (bodies_old[i2].z - bodies_old[i1].z);
-
-          // Normalize the first force direction. The magnitude will be the
-          // force calculated by newton's law of universal gravitation
-          const double magnitude1 = magnitude(x1, y1, z1);
-          const double x1_normalized = x1 / magnitude1;
-          const double y1_normalized = y1 / magnitude1;
-          const double z1_normalized = z1 / magnitude1;
-
-          // Multiply by force to set the magnitude of the first force
-          // direction. Account for mass for final expression
-          const double x1_force = x1_normalized * force;
-          const double y1_force = y1_normalized * force;
-          const double z1_force = z1_normalized * force;
-
-          // The second force direction for the second body is just the opposite
-          // of the first
-          const double x2_force = -x1_force;
-          const double y2_force = -y1_force;
-          const double z2_force = -z1_force;
-
-          // Calculate and apply the acceleration to the velocity of the first
-          // body
-          bodies[i1].vx += x1_force / bodies[i1].mass;
-          bodies[i1].vy += y1_force / bodies[i1].mass;
-          bodies[i1].vz += z1_force / bodies[i1].mass;
-
-          // Do do the same for the second body
-          bodies[i2].vx += x2_force / bodies[i2].mass;
-          bodies[i2].vy += y2_force / bodies[i2].mass;
-          bodies[i2].vz += z2_force / bodies[i2].mass;
-        }
-      }
+      ScopedTimer timer(timers, Phase::force);
+      potential = accelerate(bodies, gravitational_constant, options.solver,
+                             options.precision, sample_diagnostics);
     }
 
     // Center all bodies around point (0, 0, 0). Prevents overflow or
     // imprecision if bodies travel too far from point (0, 0, 0).
-    // Doesn't help if bodies are far from each other.
+    // Doesn't help if bodies are far from each other. The center comes from
+    // the bounds sweep.
     {
-      // Sum all the position of the bodies
-      double xsum = 0;
-      double ysum = 0;
-      double zsum = 0;
-      for (Body const &body : bodies) {
-        xsum += body.x;
-        ysum += body.y;
-        zsum += body.z;
-      }
+      ScopedTimer timer(timers, Phase::recentre);
+      map_camera.translate(-bounds.center_x(), -bounds.center_y(),
+                           -bounds.center_z());
+      recentre(bodies, bounds);
+    }
+    updateCount++;
 
-      // Average the sum all the position of the bodies which also the center
-      // point of all bodies
-      const double cx = xsum / number_of_bodies;
-      const double cy = ysum / number_of_bodies;
-      const double cz = zsum / number_of_bodies;
-
-      // Offset all bodies by the center point to make point (0, 0, 0) be the
-      // center of all bodies
-      for (Body &body : bodies) {
-        body.x -= cx;
-        body.y -= cy;
-        body.z -= cz;
+    // Save everything needed to carry on from here if the run is stopped.
+    ScopedTimer timer(timers, Phase::output);
+    if (checkpoint_writer && updateCount % options.checkpoint_every == 0) {
+      state.update_count = updateCount;
+      checkpoint_writer->save(bodies, state);
+    }
+    if (trajectory_writer && updateCount % options.trajectory_every == 0)
+      trajectory_writer->append(bodies, updateCount);
+    if (snapshot_writer && updateCount % options.snapshot_every == 0)
+      snapshot_writer->write(bodies, updateCount);
+    if (snapshot_publisher) {
+      state.update_count = updateCount;
+      snapshot_publisher->publish(bodies, state);
+    }
+    if (sample_diagnostics)
+      diagnostics_log->write(
+          measure_diagnostics(bodies, potential, updateCount));
+
+    if (metrics_exporter) {
+      constexpr auto relaxed = std::memory_order_relaxed;
+      const std::chrono::duration<double> update_time =
+          std::chrono::high_resolution_clock::now() - now_time;
+      metrics.updates.store(updateCount, relaxed);
+      metrics.interactions.fetch_add(interactions, relaxed);
+      metrics.update_seconds.store(update_time.count(), relaxed);
+      for (size_t p = 0; p < metrics.phase_seconds.size(); p++)
+        metrics.phase_seconds[p].store(timers.total_ns((Phase)p) / 1e9,
+                                       relaxed);
+      if (diagnostics_log && diagnostics_log->sample_count() > 0) {
+        metrics.energy_error.store(diagnostics_log->energy_error(), relaxed);
+        metrics.has_energy_error.store(true, relaxed);
       }
+      metrics.console_frames_dropped.store(console ? console->dropped() : 0,
+                                           relaxed);
+      metrics.images_dropped.store(image_writer ? image_writer->dropped() : 0,
+                                   relaxed);
+      metrics.snapshots_skipped.store(
+          snapshot_writer ? snapshot_writer->skipped() : 0, relaxed);
+      metrics.write_failures.store(
+          (checkpoint_writer ? checkpoint_writer->failures() : 0) +
+              (image_writer ? image_writer->failures() : 0) +
+              (snapshot_writer ? snapshot_writer->failures() : 0) +
+              (trajectory_writer ? trajectory_writer->failures() : 0),
+          relaxed);
+    }
+  }
+
+  // Let the console writer finish its last frame before the report.
+  console.reset();
+  if (trajectory_writer) {
+    // the last chunk is only written now, count it in the last metrics too
+    const uint64_t counted = trajectory_writer->failures();
+    trajectory_writer->close();
+    metrics.write_failures.fetch_add(trajectory_writer->failures() - counted,
+                                     std::memory_order_relaxed);
+    if (trajectory_writer->failed())
+      std::cerr << std::format("trajectory {} is incomplete, {} chunks "
+                               "couldn't be written\n",
+                               options.trajectory_path,
+                               trajectory_writer->failures());
+  }
+  if (timers_enabled) {
+    std::cerr << '\n' << timers.report();
+    if (counters) {
+      if (!counters->problem().empty())
+        std::cerr << "performance counters: " << counters->problem() << '\n';
+      std::cerr << timers.counter_report(interactions);
     }
-    updateCount++;
   }
+  std::cerr << memory_report();
+  write_trace(options);
+  return 0;
 }
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped into memory. Pages are only read from disk when they
+// are touched, so opening even a huge file is instant. A private mapping can
+// be written to without changing the file, pages are copied on first write.
+class MappedFile {
+public:
+  enum class Access { read_only, private_copy };
+  // How a range is about to be used, passed on to the kernel.
+  enum class Advice { normal, sequential, random, will_need, dont_need };
+
+  MappedFile(const std::string &path, Access access = Access::read_only) {
+#if defined(_WIN32)
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("can't open " + path);
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    length = (size_t)file_size.QuadPart;
+    if (length > 0) {
+      mapping = CreateFileMappingA(file, nullptr,
+                                   access == Access::private_copy
+                                       ? PAGE_WRITECOPY
+                                       : PAGE_READONLY,
+                                   0, 0, nullptr);
+      if (mapping)
+        address = MapViewOfFile(mapping,
+                                access == Access::private_copy ? FILE_MAP_COPY
+                                                               : FILE_MAP_READ,
+                                0, 0, 0);
+      if (!address) {
+        close();
+        throw std::runtime_error("can't map " + path);
+      }
+    }
+#else
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("can't open " + path + ": " +
+                               std::strerror(errno));
+    struct stat status;
+    fstat(fd, &status);
+    length = (size_t)status.st_size;
+    if (length > 0) {
+      address = mmap(nullptr, length,
+                     access == Access::private_copy ? PROT_READ | PROT_WRITE
+                                                    : PROT_READ,
+                     MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED) {
+        address = nullptr;
+        close();
+        throw std::runtime_error("can't map " + path + ": " +
+                                 std::strerror(errno));
+      }
+    }
+#endif
+  }
+
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  uint8_t *data() { return (uint8_t *)address; }
+  const uint8_t *data() const { return (const uint8_t *)address; }
+  size_t size() const { return length; }
+
+  // Tell the kernel how size bytes from offset will be used. will_need starts
+  // reading them in the background so a later touch doesn't wait on the
+  // disk. Only a hint, failures are ignored and Windows ignores it entirely.
+  void advise(size_t offset, size_t size, Advice advice) const {
+#if !defined(_WIN32)
+    if (!address || offset >= length)
+      return;
+    size = std::min(size, length - offset);
+    // madvise wants a page aligned start
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t start = offset / page * page;
+    int flag = MADV_NORMAL;
+    switch (advice) {
+    case Advice::normal:
+      flag = MADV_NORMAL;
+      break;
+    case Advice::sequential:
+      flag = MADV_SEQUENTIAL;
+      break;
+    case Advice::random:
+      flag = MADV_RANDOM;
+      break;
+    case Advice::will_need:
+      flag = MADV_WILLNEED;
+      break;
+    case Advice::dont_need:
+      flag = MADV_DONTNEED;
+      break;
+    }
+    madvise((char *)address + start, size + (offset - start), flag);
+#else
+    (void)offset;
+    (void)size;
+    (void)advice;
+#endif
+  }
+
+private:
+  void close() {
+#if defined(_WIN32)
+    if (address)
+      UnmapViewOfFile(address);
+    if (mapping)
+      CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (address)
+      munmap(address, length);
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+#endif
+    address = nullptr;
+  }
+
+#if defined(_WIN32)
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#else
+  int fd = -1;
+#endif
+  void *address = nullptr;
+  size_t length = 0;
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// What memory is used for. The big allocations are charged to one of these
+// as they are made: the columns of the bodies, buffers of the writers and
+// readers, and framebuffers and images.
+enum class Subsystem : unsigned char { bodies, io, render, count };
+
+inline constexpr std::array<const char *, (size_t)Subsystem::count>
+    subsystem_names = {"bodies", "io", "render"};
+
+// Bytes every subsystem has allocated now and at most. Any thread can
+// allocate, so they are relaxed atomics; the peak is kept with a
+// compare-and-swap loop that only runs when it grows.
+class MemoryAccount {
+public:
+  void allocated(Subsystem subsystem, size_t bytes) {
+    const size_t s = (size_t)subsystem;
+    const int64_t now =
+        current[s].fetch_add((int64_t)bytes, std::memory_order_relaxed) +
+        (int64_t)bytes;
+    int64_t highest = peak[s].load(std::memory_order_relaxed);
+    while (now > highest &&
+           !peak[s].compare_exchange_weak(highest, now,
+                                          std::memory_order_relaxed))
+      ;
+  }
+
+  void freed(Subsystem subsystem, size_t bytes) {
+    current[(size_t)subsystem].fetch_sub((int64_t)bytes,
+                                         std::memory_order_relaxed);
+  }
+
+  int64_t bytes(Subsystem subsystem) const {
+    return current[(size_t)subsystem].load(std::memory_order_relaxed);
+  }
+  int64_t peak_bytes(Subsystem subsystem) const {
+    return peak[(size_t)subsystem].load(std::memory_order_relaxed);
+  }
+
+private:
+  std::array<std::atomic<int64_t>, (size_t)Subsystem::count> current{};
+  std::array<std::atomic<int64_t>, (size_t)Subsystem::count> peak{};
+};
+
+inline MemoryAccount &memory_account() {
+  static MemoryAccount account;
+  return account;
+}
+
+// Subsystem that columns allocated on this thread are charged to, bodies
+// unless a MemoryScope says otherwise.
+inline Subsystem &current_subsystem() {
+  thread_local Subsystem subsystem = Subsystem::bodies;
+  return subsystem;
+}
+
+// Charges columns allocated on this thread in its scope to subsystem, e.g.
+// the copies of the bodies the writers make.
+class MemoryScope {
+public:
+  explicit MemoryScope(Subsystem subsystem)
+      : previous(current_subsystem()) {
+    current_subsystem() = subsystem;
+  }
+  ~MemoryScope() { current_subsystem() = previous; }
+
+  MemoryScope(const MemoryScope &) = delete;
+  MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+  Subsystem previous;
+};
+
+// A std allocator that charges what it allocates to subsystem.
+template <typename T, Subsystem subsystem> struct TrackingAllocator {
+  using value_type = T;
+
+  TrackingAllocator() = default;
+  template <typename U>
+  TrackingAllocator(const TrackingAllocator<U, subsystem> &) {}
+
+  T *allocate(size_t n) {
+    T *values = std::allocator<T>().allocate(n);
+    memory_account().allocated(subsystem, n * sizeof(T));
+    return values;
+  }
+
+  void deallocate(T *values, size_t n) {
+    memory_account().freed(subsystem, n * sizeof(T));
+    std::allocator<T>().deallocate(values, n);
+  }
+
+  template <typename U> struct rebind {
+    using other = TrackingAllocator<U, subsystem>;
+  };
+
+  bool operator==(const TrackingAllocator &) const { return true; }
+};
+
+template <typename T, Subsystem subsystem>
+using TrackedVector = std::vector<T, TrackingAllocator<T, subsystem>>;
+
+// Resident memory of the process now and at its highest, from
+// /proc/self/status. 0 where that doesn't exist.
+struct ResidentMemory {
+  uint64_t bytes = 0, peak_bytes = 0;
+};
+
+inline ResidentMemory resident_memory() {
+  ResidentMemory memory;
+  std::ifstream status("/proc/self/status");
+  std::string key;
+  uint64_t kilobytes;
+  while (status >> key) {
+    if (key == "VmRSS:" && status >> kilobytes)
+      memory.bytes = kilobytes * 1024;
+    else if (key == "VmHWM:" && status >> kilobytes)
+      memory.peak_bytes = kilobytes * 1024;
+    status.ignore(256, '\n');
+  }
+  return memory;
+}
+
+inline std::string format_bytes(double bytes) {
+  if (bytes >= (1 << 30))
+    return std::format("{:.2f} GiB", bytes / (1 << 30));
+  if (bytes >= (1 << 20))
+    return std::format("{:.1f} MiB", bytes / (1 << 20));
+  if (bytes >= (1 << 10))
+    return std::format("{:.1f} KiB", bytes / (1 << 10));
+  return std::format("{:.0f} B", bytes);
+}
+
+// A size like 1073741824, 512M or 2G, in bytes. Throws
+// std::invalid_argument.
+inline uint64_t parse_bytes(const std::string &text) {
+  size_t end = 0;
+  const double value = std::stod(text, &end);
+  const std::string unit = text.substr(end);
+  double scale = 1;
+  if (unit == "K" || unit == "k" || unit == "KiB")
+    scale = 1 << 10;
+  else if (unit == "M" || unit == "MiB")
+    scale = 1 << 20;
+  else if (unit == "G" || unit == "GiB")
+    scale = 1 << 30;
+  else if (!unit.empty() && unit != "B")
+    throw std::invalid_argument("unknown size unit " + unit);
+  if (!(value > 0))
+    throw std::invalid_argument("size must be positive");
+  return (uint64_t)(value * scale);
+}
+
+// What every subsystem holds now and held at most, and the resident memory.
+inline std::string memory_report() {
+  std::string text = std::format("{:<10}{:>14}{:>14}\n", "memory", "now", "peak");
+  for (size_t s = 0; s < (size_t)Subsystem::count; s++)
+    text += std::format(
+        "{:<10}{:>14}{:>14}\n", subsystem_names[s],
+        format_bytes((double)memory_account().bytes((Subsystem)s)),
+        format_bytes((double)memory_account().peak_bytes((Subsystem)s)));
+  const ResidentMemory resident = resident_memory();
+  if (resident.peak_bytes > 0)
+    text += std::format("{:<10}{:>14}{:>14}\n", "resident",
+                        format_bytes((double)resident.bytes),
+                        format_bytes((double)resident.peak_bytes));
+  return text;
+}
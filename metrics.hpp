@@ -0,0 +1,283 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "memory.hpp"
+#include "timing.hpp"
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Numbers about the run for monitoring. The update loop stores into them with
+// relaxed atomics, nothing else, and the exporter thread reads them whenever
+// it likes; a scrape may mix two updates, which doesn't matter for metrics.
+struct Metrics {
+  std::atomic<uint64_t> updates = 0;
+  std::atomic<uint64_t> bodies = 0;
+  std::atomic<double> interactions = 0; // pair interactions so far
+  std::atomic<double> update_seconds = 0; // of the last update
+  std::array<std::atomic<double>, (size_t)Phase::count> phase_seconds{};
+  std::atomic<bool> has_energy_error = false;
+  std::atomic<double> energy_error = 0;
+  std::atomic<uint64_t> console_frames_dropped = 0;
+  std::atomic<uint64_t> images_dropped = 0;
+  std::atomic<uint64_t> snapshots_skipped = 0;
+  // checkpoints, images, snapshots and trajectory chunks
+  std::atomic<uint64_t> write_failures = 0;
+};
+
+// Metrics in the Prometheus text exposition format.
+inline std::string prometheus_text(const Metrics &metrics) {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  std::string text;
+  const auto add = [&](const char *name, const char *type, const char *help,
+                       const std::string &samples) {
+    text += std::format("# HELP {} {}\n# TYPE {} {}\n{}", name, help, name,
+                        type, samples);
+  };
+  const auto sample = [](const char *name, auto value) {
+    return std::format("{} {}\n", name, value);
+  };
+
+  add("nbody_updates_total", "counter", "Updates done.",
+      sample("nbody_updates_total", metrics.updates.load(relaxed)));
+  add("nbody_bodies", "gauge", "Bodies simulated.",
+      sample("nbody_bodies", metrics.bodies.load(relaxed)));
+  add("nbody_interactions_total", "counter",
+      "Pair interactions computed by the force loop.",
+      sample("nbody_interactions_total", metrics.interactions.load(relaxed)));
+  add("nbody_update_seconds", "gauge", "Wall time of the last update.",
+      sample("nbody_update_seconds", metrics.update_seconds.load(relaxed)));
+  std::string phases;
+  for (size_t p = 0; p < metrics.phase_seconds.size(); p++)
+    phases += std::format("nbody_phase_seconds_total{{phase=\"{}\"}} {}\n",
+                          phase_names[p],
+                          metrics.phase_seconds[p].load(relaxed));
+  add("nbody_phase_seconds_total", "counter",
+      "Wall time spent in each phase of the update.", phases);
+  if (metrics.has_energy_error.load(relaxed))
+    add("nbody_energy_error", "gauge",
+        "Relative total energy change since the first diagnostics sample.",
+        sample("nbody_energy_error", metrics.energy_error.load(relaxed)));
+  add("nbody_console_frames_dropped_total", "counter",
+      "Console frames dropped because the terminal was still busy.",
+      sample("nbody_console_frames_dropped_total",
+             metrics.console_frames_dropped.load(relaxed)));
+  add("nbody_images_dropped_total", "counter",
+      "Images dropped because encoding or the disk was behind.",
+      sample("nbody_images_dropped_total",
+             metrics.images_dropped.load(relaxed)));
+  add("nbody_snapshots_skipped_total", "counter",
+      "Snapshots skipped because the last one was still being written.",
+      sample("nbody_snapshots_skipped_total",
+             metrics.snapshots_skipped.load(relaxed)));
+  add("nbody_write_failures_total", "counter",
+      "Checkpoints, images, snapshots and trajectory chunks that couldn't be "
+      "written.",
+      sample("nbody_write_failures_total",
+             metrics.write_failures.load(relaxed)));
+  std::string subsystems;
+  for (size_t s = 0; s < (size_t)Subsystem::count; s++)
+    subsystems += std::format("nbody_memory_bytes{{subsystem=\"{}\"}} {}\n",
+                              subsystem_names[s],
+                              memory_account().bytes((Subsystem)s));
+  add("nbody_memory_bytes", "gauge", "Bytes allocated by each subsystem.",
+      subsystems);
+  const ResidentMemory resident = resident_memory();
+  add("nbody_resident_bytes", "gauge", "Resident memory of the process.",
+      sample("nbody_resident_bytes", resident.bytes));
+  add("nbody_resident_peak_bytes", "gauge",
+      "Highest resident memory of the process.",
+      sample("nbody_resident_peak_bytes", resident.peak_bytes));
+  return text;
+}
+
+// Exports metrics from a background thread, either as a file rewritten every
+// interval, written to a temporary file and renamed over the old one so a
+// reader never sees half of it, or with "unix:PATH" served on a Unix domain
+// socket to anything that connects, e.g.
+// curl --unix-socket PATH http://localhost/metrics. The file is written once
+// more and the socket removed when the exporter goes away.
+class MetricsExporter {
+public:
+  // Throws std::runtime_error if the socket can't be set up.
+  MetricsExporter(std::string target, double interval_seconds,
+                  const Metrics &metrics)
+      : metrics(metrics),
+        interval(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::duration<double>(interval_seconds))) {
+    if (target.starts_with("unix:")) {
+      socket_path = target.substr(5);
+      listen_on(socket_path);
+    } else {
+      path = std::move(target);
+    }
+    thread = std::thread([this] { run(); });
+  }
+
+  ~MetricsExporter() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    stop.notify_all();
+    thread.join();
+#if !defined(_WIN32)
+    if (listener >= 0) {
+      ::close(listener);
+      unlink(socket_path.c_str());
+    }
+#endif
+  }
+
+  MetricsExporter(const MetricsExporter &) = delete;
+  MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+  uint64_t failures() const { return failed_writes; }
+
+private:
+  void run() {
+    std::unique_lock lock(mutex);
+    while (true) {
+      const bool last = stopping;
+      lock.unlock();
+      if (!path.empty())
+        write_file();
+      else
+        serve();
+      lock.lock();
+      if (last)
+        return;
+      // the socket waits for clients in serve() instead
+      if (!path.empty())
+        stop.wait_for(lock, interval, [this] { return stopping; });
+    }
+  }
+
+  void write_file() {
+    const std::string text = prometheus_text(metrics);
+    const std::string temporary_path = path + ".tmp";
+    std::FILE *file = std::fopen(temporary_path.c_str(), "wb");
+    bool ok = file != nullptr;
+    if (file) {
+      ok = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+      ok = std::fclose(file) == 0 && ok;
+    }
+    std::error_code error;
+    if (ok)
+      std::filesystem::rename(temporary_path, path, error);
+    if (!ok || error)
+      failed_writes++;
+  }
+
+#if defined(_WIN32)
+  void listen_on(const std::string &) {
+    throw std::runtime_error("metrics on a socket need a Unix system");
+  }
+  void serve() {}
+#else
+  void listen_on(const std::string &socket) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket.empty() || socket.size() >= sizeof(address.sun_path))
+      throw std::runtime_error("bad metrics socket path " + socket);
+    std::memcpy(address.sun_path, socket.c_str(), socket.size() + 1);
+    listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+      throw std::runtime_error("can't create metrics socket: " +
+                               std::string(std::strerror(errno)));
+    // a socket left behind by a run that was killed
+    unlink(socket.c_str());
+    if (bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, 8) != 0) {
+      const int error = errno;
+      ::close(listener);
+      listener = -1;
+      throw std::runtime_error("can't listen on " + socket + ": " +
+                               std::strerror(error));
+    }
+  }
+
+  // a client that hangs up early mustn't kill the simulation with SIGPIPE
+#if defined(MSG_NOSIGNAL)
+  static constexpr int no_signal = MSG_NOSIGNAL;
+#else
+  static constexpr int no_signal = 0;
+#endif
+
+  // Answer the clients that connect within one interval, as HTTP/1.0 so
+  // Prometheus and curl can scrape it, whatever they ask for.
+  void serve() {
+    const auto deadline = std::chrono::steady_clock::now() + interval;
+    while (true) {
+      {
+        std::lock_guard lock(mutex);
+        if (stopping)
+          return;
+      }
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0)
+        return;
+      // wake up now and then to notice stopping
+      pollfd waiting = {listener, POLLIN, 0};
+      if (poll(&waiting, 1, (int)std::min<long long>(left.count(), 100)) <= 0)
+        continue;
+      const int client = accept(listener, nullptr, nullptr);
+      if (client < 0)
+        continue;
+      // read the request, if it comes quickly, so closing doesn't reset it
+      pollfd request = {client, POLLIN, 0};
+      char buffer[1024];
+      if (poll(&request, 1, 100) > 0)
+        (void)!::read(client, buffer, sizeof(buffer));
+      const std::string body = prometheus_text(metrics);
+      const std::string response =
+          std::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                      "version=0.0.4\r\nContent-Length: {}\r\n\r\n{}",
+                      body.size(), body);
+      size_t written = 0;
+      while (written < response.size()) {
+        const ssize_t count = ::send(client, response.data() + written,
+                                     response.size() - written, no_signal);
+        if (count < 0 && errno == EINTR)
+          continue;
+        if (count <= 0) {
+          failed_writes++;
+          break;
+        }
+        written += count;
+      }
+      ::close(client);
+    }
+  }
+#endif
+
+  const Metrics &metrics;
+  const std::chrono::milliseconds interval;
+  std::string path;        // file export
+  std::string socket_path; // socket export
+  int listener = -1;
+  std::atomic<uint64_t> failed_writes = 0;
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable stop;
+  std::thread thread; // last so everything above exists when it starts
+};
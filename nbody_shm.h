@@ -0,0 +1,161 @@
+/* Layout of the shared memory snapshots the simulation publishes with
+ * --shm NAME, and a small reader for C and C++ programs on the same machine.
+ *
+ * The region is a header followed by slot_count slots. Every slot holds one
+ * snapshot: a slot header, then the x, y, z, vx, vy, vz and mass columns as
+ * doubles, each starting at a 64 byte boundary. The writer fills the slots
+ * round robin and never waits for readers. A slot's sequence number is odd
+ * while it is being written and goes up by 2 on every write, so a reader
+ * that sees the same even number before and after copying got a whole
+ * snapshot (a seqlock). A reader that is too slow simply retries with a
+ * newer snapshot.
+ *
+ *   struct nbody_shm_reader reader;
+ *   if (nbody_shm_open(&reader, "/nbody") == 0) {
+ *     size_t n = reader.header->number_of_bodies;
+ *     double *x = malloc(n * sizeof(double)), *y = ..., *z = ...;
+ *     double *columns[NBODY_SHM_COLUMNS] = {x, y, z, 0, 0, 0, 0};
+ *     uint64_t step;
+ *     if (nbody_shm_read_latest(&reader, columns, &step) == 0)
+ *       ... positions of update step are in x, y and z ...
+ *     nbody_shm_close(&reader);
+ *   }
+ *
+ * Needs POSIX shared memory and the GCC/Clang __atomic builtins. */
+#ifndef NBODY_SHM_H
+#define NBODY_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NBODY_SHM_MAGIC 0x4d485359444f424eull /* "NBODYSHM" little endian */
+#define NBODY_SHM_VERSION 1
+#define NBODY_SHM_COLUMNS 7
+
+struct nbody_shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint64_t number_of_bodies;
+  uint64_t slot_size;    /* bytes per slot, a multiple of the page size */
+  uint64_t slots_offset; /* byte offset of slot 0 from the header */
+  /* Snapshots published so far. The newest is in slot
+   * (published - 1) % slot_count. Updated after the slot is complete. */
+  uint64_t published;
+  double gravitational_constant;
+  uint64_t reserved;
+};
+
+struct nbody_shm_slot {
+  uint64_t sequence; /* odd while the writer is in this slot */
+  uint64_t step;     /* update count of the snapshot */
+  double time;
+  uint64_t reserved;
+  /* byte offsets of x, y, z, vx, vy, vz and mass from the slot start */
+  uint64_t column_offsets[NBODY_SHM_COLUMNS];
+  uint64_t padding;
+};
+
+struct nbody_shm_reader {
+  const struct nbody_shm_header *header;
+  size_t size;
+};
+
+static inline const struct nbody_shm_slot *
+nbody_shm_slot_at(const struct nbody_shm_header *header, uint64_t slot) {
+  return (const struct nbody_shm_slot *)((const char *)header +
+                                         header->slots_offset +
+                                         slot * header->slot_size);
+}
+
+/* Map the snapshots published under name read only. Returns 0, or -1 if
+ * there is no such region or it isn't from a compatible writer. */
+static inline int nbody_shm_open(struct nbody_shm_reader *reader,
+                                 const char *name) {
+  struct stat status;
+  void *address;
+  const struct nbody_shm_header *header;
+  int fd = shm_open(name, O_RDONLY, 0);
+  reader->header = 0;
+  reader->size = 0;
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &status) != 0 ||
+      (size_t)status.st_size < sizeof(struct nbody_shm_header)) {
+    close(fd);
+    return -1;
+  }
+  address = mmap(0, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED)
+    return -1;
+  header = (const struct nbody_shm_header *)address;
+  if (header->magic != NBODY_SHM_MAGIC ||
+      header->version != NBODY_SHM_VERSION ||
+      header->slots_offset + header->slot_count * header->slot_size >
+          (uint64_t)status.st_size) {
+    munmap(address, (size_t)status.st_size);
+    return -1;
+  }
+  reader->header = header;
+  reader->size = (size_t)status.st_size;
+  return 0;
+}
+
+static inline void nbody_shm_close(struct nbody_shm_reader *reader) {
+  if (reader->header)
+    munmap((void *)reader->header, reader->size);
+  reader->header = 0;
+  reader->size = 0;
+}
+
+/* Copy the newest snapshot into columns[0..6] (x, y, z, vx, vy, vz, mass),
+ * each with room for number_of_bodies doubles. A null column is skipped.
+ * Returns 0, 1 if nothing has been published yet, or -1 if no consistent
+ * snapshot could be read after many tries. */
+static inline int nbody_shm_read_latest(const struct nbody_shm_reader *reader,
+                                        double *const *columns,
+                                        uint64_t *step) {
+  const struct nbody_shm_header *header = reader->header;
+  int attempt, c;
+  for (attempt = 0; attempt < 1000; attempt++) {
+    const uint64_t published =
+        __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+    const struct nbody_shm_slot *slot;
+    uint64_t before, after, slot_step;
+    if (published == 0)
+      return 1;
+    slot = nbody_shm_slot_at(header, (published - 1) % header->slot_count);
+    before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1)
+      continue;
+    slot_step = slot->step;
+    for (c = 0; c < NBODY_SHM_COLUMNS; c++) {
+      if (columns[c])
+        memcpy(columns[c], (const char *)slot + slot->column_offsets[c],
+               header->number_of_bodies * sizeof(double));
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    if (before == after) {
+      if (step)
+        *step = slot_step;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
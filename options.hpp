@@ -0,0 +1,449 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "camera.hpp"
+#include "compression.hpp"
+#include "filter.hpp"
+#include "image.hpp"
+#include "initial_conditions.hpp"
+#include "loader.hpp"
+#include "memory.hpp"
+#include "physics.hpp"
+#include "render.hpp"
+#include "video.hpp"
+
+// Settings that can be changed from the command line without recompiling.
+struct Options {
+  uint number_of_bodies = 1000;
+  // Seed of the random initial conditions, a different one every run unless
+  // given.
+  uint64_t seed = (uint64_t)std::time(nullptr);
+  InitialConditions initial_conditions;
+  // Initial conditions from a file instead of random. Empty means random.
+  std::string load_path;
+  LoadFormat load_format = LoadFormat::text;
+  RenderMode render_mode = RenderMode::map;
+  DensityWeight density_weight = DensityWeight::count;
+  uint threads = 0; // 0 means every hardware thread
+  Solver solver = Solver::pairwise;
+  Precision precision = Precision::full;
+  uint updates = 0; // updates to run before exiting, 0 runs until stopped
+  std::string trace_path; // Chrome trace of the run, empty means no tracing
+  bool perf_counters = false; // hardware counters per phase
+
+  // Prometheus metrics, a file or "unix:PATH" for a socket. Empty means none.
+  std::string metrics_target;
+  double metrics_interval = 1; // seconds
+
+  // Refuse to start if the run would need more bytes than this. 0 means no
+  // limit.
+  uint64_t memory_budget = 0;
+
+  // Conserved quantities as CSV. Empty path means none are measured.
+  std::string diagnostics_path;
+  uint diagnostics_every = 10; // updates per sample
+  MapCamera map_camera;
+
+  // Image sequence output. Empty directory means no images are written.
+  std::string image_directory;
+  ImageFormat image_format = ImageFormat::png;
+  uint image_width = 1280, image_height = 720;
+  Camera camera;
+
+  // Raw video stream. Empty path means no video, "-" means stdout.
+  std::string video_path;
+  VideoFormat video_format = VideoFormat::y4m;
+  uint video_every = 1; // updates per video frame
+
+  // Checkpoints. Empty path means none are written or loaded.
+  std::string checkpoint_path;
+  uint checkpoint_every = 100; // updates per checkpoint
+  std::string restart_path;
+
+  // Trajectory. Empty path means no trajectory is written.
+  std::string trajectory_path;
+  uint trajectory_every = 1; // updates per stored step
+  uint trajectory_chunk = 0; // steps per chunk, 0 picks by number of bodies
+  Codec trajectory_codec = best_codec();
+
+  // Snapshots of some or all bodies. Empty directory means none are written.
+  std::string snapshot_directory;
+  uint snapshot_every = 1; // updates per snapshot
+  OutputFilter snapshot_filter;
+  // Largest error of a quantized snapshot, 0 writes exact doubles.
+  double snapshot_error = 0;
+
+  // Play back a trajectory or checkpoint instead of simulating. Empty path
+  // means simulate.
+  std::string replay_path;
+  double replay_speed = 1; // stored steps per update
+  double replay_start = 0; // stored step to start at
+
+  // Shared memory snapshots. Empty name means none are published.
+  std::string shm_name;
+  uint shm_slots = 4;
+};
+
+inline const char *usage() {
+  return "usage: NBodySimulation [options]\n"
+         "  --bodies N                    number of bodies (default 1000)\n"
+         "  --seed S                      seed for the random bodies\n"
+         "  --model cube|plummer|king|disk|merger|cold\n"
+         "                                random initial conditions (default "
+         "cube)\n"
+         "  --model-scale R               length scale of the model (default "
+         "100)\n"
+         "  --model-mass M                total mass of the model (default 1)\n"
+         "  --virial-ratio Q              kinetic over potential energy "
+         "(default 0.5)\n"
+         "  --king-w0 W                   central potential of the King model "
+         "(default 6)\n"
+         "  --load PATH                   read the bodies from a text or binary "
+         "file\n"
+         "  --load-format text|binary|quantized\n"
+         "                                default from the extension, .bin and "
+         ".raw\n"
+         "                                are binary, .nbq quantized\n"
+         "  --render map|density|colour   how bodies are drawn (default map)\n"
+         "  --density-weight count|mass   what density maps add up per cell\n"
+         "  --map-camera exact|fixed|percentile|smoothed\n"
+         "                                what area the map and images show\n"
+         "  --map-extent X                fixed camera shows -X to X (default "
+         "1000)\n"
+         "  --map-percentile P            percentile camera leaves out P% on "
+         "each side\n"
+         "  --map-smoothing A             smoothed camera moves A of the way "
+         "each update\n"
+         "  --threads N                   worker threads, 0 for all (default "
+         "0)\n"
+         "  --solver pairwise|parallel    force loop, parallel uses every "
+         "thread\n"
+         "  --precision double|mixed|float\n"
+         "                                what the parallel solver computes in\n"
+         "  --updates N                   exit after N updates, 0 never "
+         "(default 0)\n"
+         "  --trace PATH                  write a Chrome trace of the run to "
+         "PATH\n"
+         "  --perf on|off                 count cycles and cache misses per "
+         "phase\n"
+         "  --metrics PATH|unix:PATH      export Prometheus metrics to a file "
+         "or socket\n"
+         "  --metrics-interval S          seconds between metrics files "
+         "(default 1)\n"
+         "  --memory-budget SIZE          don't start if the run needs more, "
+         "e.g. 2G\n"
+         "  --diagnostics PATH            log energy and momenta as CSV\n"
+         "  --diagnostics-every K         one sample every K updates (default "
+         "10)\n"
+         "  --image-dir DIR               write a numbered image every update\n"
+         "  --image-format png|ppm        image file format (default png)\n"
+         "  --image-size WxH              image and video resolution (default "
+         "1280x720)\n"
+         "  --camera ortho|perspective    image projection (default ortho)\n"
+         "  --video PATH                  stream frames to a pipe, - for stdout\n"
+         "  --video-format y4m|rgb        video stream format (default y4m)\n"
+         "  --video-every K               one video frame every K updates\n"
+         "  --checkpoint PATH             write a checkpoint to PATH regularly\n"
+         "  --checkpoint-every K          one checkpoint every K updates "
+         "(default 100)\n"
+         "  --restart PATH                carry on from a checkpoint\n"
+         "  --trajectory PATH             append positions and velocities to "
+         "PATH\n"
+         "  --trajectory-every K          one trajectory step every K updates\n"
+         "  --trajectory-chunk K          steps per compressed chunk\n"
+         "  --trajectory-codec none|run-length|lz4|zstd\n"
+         "                                trajectory compression (default "
+         "best built)\n"
+         "  --snapshot-dir DIR            write the bodies as numbered .bin "
+         "files\n"
+         "  --snapshot-every K            one snapshot every K updates\n"
+         "  --snapshot-filter all|every:K|box:X0,Y0,Z0,X1,Y1,Z1|sphere:X,Y,Z,R|"
+         "top-mass:M\n"
+         "                                which bodies snapshots hold "
+         "(default all)\n"
+         "  --snapshot-error E            write quantized .nbq snapshots "
+         "within E\n"
+         "  --replay PATH                 play back a trajectory or checkpoint\n"
+         "  --replay-speed S              stored steps per update, fractions "
+         "are\n"
+         "                                interpolated, negative rewinds "
+         "(default 1)\n"
+         "  --replay-start N              stored step to start playing at\n"
+         "  --shm NAME                    publish every update to shared "
+         "memory NAME\n"
+         "  --shm-slots K                 snapshots kept in shared memory "
+         "(default 4)\n";
+}
+
+// Parse the command line. Throws std::invalid_argument with a message for
+// anything it doesn't understand.
+inline Options parse_options(int argc, char **argv) {
+  Options options;
+  bool load_format_given = false;
+  bool virial_ratio_given = false;
+  for (int i = 1; i < argc; i++) {
+    const std::string_view option = argv[i];
+    // every option takes exactly one value
+    if (i + 1 >= argc)
+      throw std::invalid_argument(std::string(option) + " needs a value");
+    const std::string_view value = argv[++i];
+
+    if (option == "--bodies") {
+      options.number_of_bodies = std::stoul(std::string(value));
+      if (options.number_of_bodies < 2)
+        throw std::invalid_argument("need at least 2 bodies");
+    } else if (option == "--seed") {
+      options.seed = std::stoull(std::string(value));
+    } else if (option == "--model") {
+      Model &model = options.initial_conditions.model;
+      if (value == "cube")
+        model = Model::cube;
+      else if (value == "plummer")
+        model = Model::plummer;
+      else if (value == "king")
+        model = Model::king;
+      else if (value == "disk")
+        model = Model::disk;
+      else if (value == "merger")
+        model = Model::merger;
+      else if (value == "cold")
+        model = Model::cold;
+      else
+        throw std::invalid_argument("unknown model " + std::string(value));
+    } else if (option == "--model-scale") {
+      options.initial_conditions.scale = std::stod(std::string(value));
+      if (options.initial_conditions.scale <= 0)
+        throw std::invalid_argument("model scale must be positive");
+    } else if (option == "--model-mass") {
+      options.initial_conditions.total_mass = std::stod(std::string(value));
+      if (options.initial_conditions.total_mass <= 0)
+        throw std::invalid_argument("model mass must be positive");
+    } else if (option == "--virial-ratio") {
+      virial_ratio_given = true;
+      options.initial_conditions.virial_ratio = std::stod(std::string(value));
+      if (options.initial_conditions.virial_ratio < 0)
+        throw std::invalid_argument("virial ratio can't be negative");
+    } else if (option == "--king-w0") {
+      options.initial_conditions.king_w0 = std::stod(std::string(value));
+      if (options.initial_conditions.king_w0 <= 0 ||
+          options.initial_conditions.king_w0 > 16)
+        throw std::invalid_argument("King W0 must be between 0 and 16");
+    } else if (option == "--load") {
+      options.load_path = value;
+      if (!load_format_given)
+        options.load_format = load_format_of(options.load_path);
+    } else if (option == "--load-format") {
+      load_format_given = true;
+      if (value == "text")
+        options.load_format = LoadFormat::text;
+      else if (value == "binary")
+        options.load_format = LoadFormat::binary;
+      else if (value == "quantized")
+        options.load_format = LoadFormat::quantized;
+      else
+        throw std::invalid_argument("unknown load format " +
+                                    std::string(value));
+    } else if (option == "--render") {
+      if (value == "map")
+        options.render_mode = RenderMode::map;
+      else if (value == "density")
+        options.render_mode = RenderMode::density;
+      else if (value == "colour" || value == "color")
+        options.render_mode = RenderMode::density_colour;
+      else
+        throw std::invalid_argument("unknown render mode " +
+                                    std::string(value));
+    } else if (option == "--density-weight") {
+      if (value == "count")
+        options.density_weight = DensityWeight::count;
+      else if (value == "mass")
+        options.density_weight = DensityWeight::mass;
+      else
+        throw std::invalid_argument("unknown density weight " +
+                                    std::string(value));
+    } else if (option == "--map-camera") {
+      if (value == "exact")
+        options.map_camera.mode = MapCameraMode::exact;
+      else if (value == "fixed")
+        options.map_camera.mode = MapCameraMode::fixed;
+      else if (value == "percentile")
+        options.map_camera.mode = MapCameraMode::percentile;
+      else if (value == "smoothed")
+        options.map_camera.mode = MapCameraMode::smoothed;
+      else
+        throw std::invalid_argument("unknown map camera " + std::string(value));
+    } else if (option == "--map-extent") {
+      options.map_camera.extent = std::stod(std::string(value));
+      if (!(options.map_camera.extent > 0))
+        throw std::invalid_argument("--map-extent must be above 0");
+    } else if (option == "--map-percentile") {
+      options.map_camera.percentile = std::stod(std::string(value));
+      if (!(options.map_camera.percentile >= 0 &&
+            options.map_camera.percentile < 50))
+        throw std::invalid_argument("--map-percentile must be at least 0 and "
+                                    "below 50");
+    } else if (option == "--map-smoothing") {
+      options.map_camera.smoothing = std::stod(std::string(value));
+      if (!(options.map_camera.smoothing > 0 &&
+            options.map_camera.smoothing <= 1))
+        throw std::invalid_argument("--map-smoothing must be above 0 and at "
+                                    "most 1");
+    } else if (option == "--threads") {
+      options.threads = std::stoul(std::string(value));
+    } else if (option == "--image-dir") {
+      options.image_directory = value;
+    } else if (option == "--image-format") {
+      if (value == "png")
+        options.image_format = ImageFormat::png;
+      else if (value == "ppm")
+        options.image_format = ImageFormat::ppm;
+      else
+        throw std::invalid_argument("unknown image format " +
+                                    std::string(value));
+    } else if (option == "--image-size" || option == "--video-size") {
+      const size_t x = value.find('x');
+      if (x == std::string_view::npos)
+        throw std::invalid_argument("image size must look like 1920x1080");
+      options.image_width = std::stoul(std::string(value.substr(0, x)));
+      options.image_height = std::stoul(std::string(value.substr(x + 1)));
+      if (options.image_width == 0 || options.image_height == 0)
+        throw std::invalid_argument("image size can't be zero");
+    } else if (option == "--camera") {
+      if (value == "ortho" || value == "orthographic")
+        options.camera.projection = Projection::orthographic;
+      else if (value == "perspective")
+        options.camera.projection = Projection::perspective;
+      else
+        throw std::invalid_argument("unknown camera " + std::string(value));
+    } else if (option == "--video") {
+      options.video_path = value;
+    } else if (option == "--video-format") {
+      if (value == "y4m")
+        options.video_format = VideoFormat::y4m;
+      else if (value == "rgb")
+        options.video_format = VideoFormat::rgb;
+      else
+        throw std::invalid_argument("unknown video format " +
+                                    std::string(value));
+    } else if (option == "--video-every") {
+      options.video_every = std::stoul(std::string(value));
+      if (options.video_every == 0)
+        throw std::invalid_argument("video every must be at least 1");
+    } else if (option == "--checkpoint") {
+      options.checkpoint_path = value;
+    } else if (option == "--checkpoint-every") {
+      options.checkpoint_every = std::stoul(std::string(value));
+      if (options.checkpoint_every == 0)
+        throw std::invalid_argument("checkpoint every must be at least 1");
+    } else if (option == "--restart") {
+      options.restart_path = value;
+    } else if (option == "--trajectory") {
+      options.trajectory_path = value;
+    } else if (option == "--trajectory-every") {
+      options.trajectory_every = std::stoul(std::string(value));
+      if (options.trajectory_every == 0)
+        throw std::invalid_argument("trajectory every must be at least 1");
+    } else if (option == "--trajectory-chunk") {
+      options.trajectory_chunk = std::stoul(std::string(value));
+    } else if (option == "--trajectory-codec") {
+      bool found = false;
+      for (Codec codec :
+           {Codec::none, Codec::run_length, Codec::lz4, Codec::zstd}) {
+        if (value == codec_name(codec)) {
+          options.trajectory_codec = codec;
+          found = true;
+        }
+      }
+      if (!found)
+        throw std::invalid_argument("unknown codec " + std::string(value));
+      if (!codec_available(options.trajectory_codec))
+        throw std::invalid_argument("this build has no " + std::string(value) +
+                                    " support");
+    } else if (option == "--solver") {
+      if (value == "pairwise")
+        options.solver = Solver::pairwise;
+      else if (value == "parallel")
+        options.solver = Solver::parallel;
+      else
+        throw std::invalid_argument("unknown solver " + std::string(value));
+    } else if (option == "--precision") {
+      if (value == "double")
+        options.precision = Precision::full;
+      else if (value == "mixed")
+        options.precision = Precision::mixed;
+      else if (value == "float")
+        options.precision = Precision::single;
+      else
+        throw std::invalid_argument("unknown precision " +
+                                    std::string(value));
+    } else if (option == "--updates") {
+      options.updates = std::stoul(std::string(value));
+    } else if (option == "--trace") {
+      options.trace_path = value;
+    } else if (option == "--perf") {
+      if (value == "on")
+        options.perf_counters = true;
+      else if (value == "off")
+        options.perf_counters = false;
+      else
+        throw std::invalid_argument("--perf is on or off");
+    } else if (option == "--metrics") {
+      options.metrics_target = value;
+    } else if (option == "--metrics-interval") {
+      options.metrics_interval = std::stod(std::string(value));
+      if (!(options.metrics_interval > 0))
+        throw std::invalid_argument("metrics interval must be positive");
+    } else if (option == "--memory-budget") {
+      options.memory_budget = parse_bytes(std::string(value));
+    } else if (option == "--diagnostics") {
+      options.diagnostics_path = value;
+    } else if (option == "--diagnostics-every") {
+      options.diagnostics_every = std::stoul(std::string(value));
+      if (options.diagnostics_every == 0)
+        throw std::invalid_argument("diagnostics every must be at least 1");
+    } else if (option == "--snapshot-dir") {
+      options.snapshot_directory = value;
+    } else if (option == "--snapshot-every") {
+      options.snapshot_every = std::stoul(std::string(value));
+      if (options.snapshot_every == 0)
+        throw std::invalid_argument("snapshot every must be at least 1");
+    } else if (option == "--snapshot-filter") {
+      options.snapshot_filter = parse_output_filter(value);
+    } else if (option == "--snapshot-error") {
+      options.snapshot_error = std::stod(std::string(value));
+      if (options.snapshot_error < 0)
+        throw std::invalid_argument("snapshot error can't be negative");
+    } else if (option == "--replay") {
+      options.replay_path = value;
+    } else if (option == "--replay-speed") {
+      options.replay_speed = std::stod(std::string(value));
+      if (options.replay_speed == 0)
+        throw std::invalid_argument("replay speed can't be 0");
+    } else if (option == "--replay-start") {
+      options.replay_start = std::stod(std::string(value));
+      if (options.replay_start < 0)
+        throw std::invalid_argument("replay start can't be negative");
+    } else if (option == "--shm") {
+      options.shm_name = value;
+    } else if (option == "--shm-slots") {
+      options.shm_slots = std::stoul(std::string(value));
+      if (options.shm_slots < 2)
+        throw std::invalid_argument("need at least 2 shared memory slots");
+    } else {
+      throw std::invalid_argument("unknown option " + std::string(option));
+    }
+  }
+  if (options.precision != Precision::full &&
+      options.solver != Solver::parallel)
+    throw std::invalid_argument("only the parallel solver has other "
+                                "precisions");
+  // a cold collapse starts at rest unless asked otherwise
+  if (options.initial_conditions.model == Model::cold && !virial_ratio_given)
+    options.initial_conditions.virial_ratio = 0;
+  return options;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Number of threads parallel_for splits work over. 0 means use every hardware
+// thread.
+inline unsigned &thread_count_setting() {
+  static unsigned count = 0;
+  return count;
+}
+
+inline void set_thread_count(unsigned count) { thread_count_setting() = count; }
+
+inline unsigned thread_count() {
+  if (thread_count_setting() != 0)
+    return thread_count_setting();
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// CPUs the process may run on, as when first asked.
+inline const std::vector<int> &allowed_cpus() {
+  static const std::vector<int> cpus = [] {
+    std::vector<int> allowed;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+          allowed.push_back(cpu);
+#endif
+    return allowed;
+  }();
+  return cpus;
+}
+
+// Run the calling thread only on the index-th allowed CPU, wrapping around,
+// or on every allowed CPU again with a negative index. Does nothing outside
+// Linux.
+inline void pin_to_cpu(int index) {
+#if defined(__linux__)
+  const std::vector<int> &cpus = allowed_cpus();
+  if (cpus.empty())
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (index < 0)
+    for (int cpu : cpus)
+      CPU_SET(cpu, &set);
+  else
+    CPU_SET(cpus[index % cpus.size()], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)index;
+#endif
+}
+
+// Whether parallel_for pins chunk t to the t-th allowed CPU, so the thread
+// running it stays on one core for the whole call instead of being moved by
+// the scheduler. The calling thread runs chunk 0, so it is pinned to the
+// first CPU until pinning is turned off again.
+inline bool &pin_threads_setting() {
+  static bool pin = false;
+  return pin;
+}
+
+inline void set_thread_pinning(bool pin) {
+  // threads started later inherit the caller's CPUs
+  if (pin_threads_setting() && !pin)
+    pin_to_cpu(-1);
+  pin_threads_setting() = pin;
+}
+
+// How many chunks parallel_for will split n items into. Use it to size
+// per-thread scratch buffers.
+inline unsigned parallel_for_chunks(size_t n, size_t min_chunk = 4096) {
+  const size_t max_threads = std::max<size_t>(1, n / std::max<size_t>(1, min_chunk));
+  return (unsigned)std::min<size_t>(thread_count(), max_threads);
+}
+
+// Split [0, n) into one contiguous chunk per thread and call
+// function(begin, end, thread_index) for every chunk. The calling thread runs
+// the first chunk so a single thread never spawns anything. Chunks smaller than
+// min_chunk are merged so tiny inputs don't pay for thread creation. If a
+// chunk throws, the first exception is rethrown once every chunk is done.
+template <typename Function>
+void parallel_for(size_t n, Function function, size_t min_chunk = 4096) {
+  const size_t threads = parallel_for_chunks(n, min_chunk);
+  if (threads <= 1) {
+    if (pin_threads_setting())
+      pin_to_cpu(0);
+    TraceScope trace("parallel_for", n);
+    function(size_t{0}, n, 0u);
+    return;
+  }
+
+  std::vector<std::exception_ptr> errors(threads);
+  const bool pin = pin_threads_setting();
+  const auto run = [&](size_t begin, size_t end, unsigned thread) {
+    if (pin)
+      pin_to_cpu((int)thread);
+    TraceScope trace("parallel_for", end - begin);
+    try {
+      function(begin, end, thread);
+    } catch (...) {
+      errors[thread] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  for (size_t t = 1; t < threads; t++) {
+    workers.emplace_back(run, n * t / threads, n * (t + 1) / threads,
+                         (unsigned)t);
+  }
+  run(size_t{0}, n / threads, 0u);
+  for (std::thread &worker : workers)
+    worker.join();
+  for (const std::exception_ptr &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+// A fixed set of background threads running queued tasks in order. Used for
+// work that must not hold up the update loop, like encoding and writing files.
+// Destroying the pool finishes every queued task first.
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned threads) {
+    for (unsigned i = 0; i < std::max(1u, threads); i++)
+      workers.emplace_back([this] { run(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    task_ready.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard lock(mutex);
+      tasks.push_back(std::move(task));
+      busy++;
+    }
+    task_ready.notify_one();
+  }
+
+  // Tasks that are queued or running.
+  size_t pending() {
+    std::lock_guard lock(mutex);
+    return busy;
+  }
+
+  // Block until at most at_most tasks are queued or running. A pool with one
+  // thread runs tasks in order, so waiting for at most 1 there means
+  // everything but the latest task has finished.
+  void wait(size_t at_most = 0) {
+    std::unique_lock lock(mutex);
+    task_done.wait(lock, [&] { return busy <= at_most; });
+  }
+
+  // Tasks that threw. An exception leaving a worker thread would end the
+  // program, so it is caught and counted instead; tasks that need to know
+  // catch their own.
+  size_t failures() {
+    std::lock_guard lock(mutex);
+    return failed;
+  }
+
+private:
+  void run() {
+    tracer().name_thread("background");
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock(mutex);
+        task_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      bool threw = false;
+      {
+        TraceScope trace("background task");
+        try {
+          task();
+        } catch (...) {
+          threw = true;
+        }
+      }
+      {
+        std::lock_guard lock(mutex);
+        busy--;
+        failed += threw;
+      }
+      task_done.notify_all();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  size_t busy = 0;
+  size_t failed = 0;
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable task_ready;
+  std::condition_variable task_done;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "body.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware events counted per phase.
+enum class Counter : uint {
+  cycles,
+  instructions,
+  l1d_misses, // level 1 data cache read misses
+  llc_misses, // last level cache misses
+  count
+};
+
+inline constexpr std::array<const char *, (size_t)Counter::count>
+    counter_names = {"cycles", "instructions", "L1d misses", "LLC misses"};
+
+using CounterValues = std::array<uint64_t, (size_t)Counter::count>;
+
+// Double precision flops per cycle per core the build can reach at best: two
+// vector FMA units of the widest width the compiler targets.
+inline constexpr double peak_flops_per_cycle =
+#if defined(__AVX512F__)
+    32;
+#elif defined(__FMA__)
+    16;
+#elif defined(__AVX__)
+    8;
+#else
+    4;
+#endif
+
+// Hardware performance counters of this thread and every thread it starts
+// from now on, through Linux perf_event_open. The events are opened as one
+// group so they are always scheduled on the PMU together, user space only so
+// a perf_event_paranoid of 2 (the usual default) is enough without root.
+// Threads that already exist aren't counted, so open them after the
+// background writers are started to leave their I/O out.
+//
+// Counters that can't be opened, because the kernel doesn't allow it, the CPU
+// or a virtual machine doesn't have them or it isn't Linux, are left out and
+// problem() says why; reading then gives 0 for them.
+class PerfCounters {
+public:
+  PerfCounters() {
+    fds.fill(-1);
+#if defined(__linux__)
+    struct Event {
+      uint32_t type;
+      uint64_t config;
+    };
+    const std::array<Event, (size_t)Counter::count> events = {{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    }};
+    int leader = -1, first_error = 0;
+    for (size_t c = 0; c < events.size(); c++) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[c].type;
+      attr.config = events[c].config;
+      attr.disabled = leader == -1; // the group starts with its leader
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      const int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader,
+                                  PERF_FLAG_FD_CLOEXEC);
+      if (fd < 0) {
+        if (first_error == 0)
+          first_error = errno;
+        add_problem(std::string("no ") + counter_names[c] + ": " +
+                    explain(errno));
+        continue;
+      }
+      fds[c] = fd;
+      if (leader == -1)
+        leader = fd;
+    }
+    if (leader == -1)
+      problems = "none available, " + explain(first_error);
+    else
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, 0);
+#else
+    add_problem("performance counters need Linux");
+#endif
+  }
+
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (int fd : fds)
+      if (fd >= 0)
+        close(fd);
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  bool available() const {
+    for (int fd : fds)
+      if (fd >= 0)
+        return true;
+    return false;
+  }
+  bool has(Counter counter) const { return fds[(size_t)counter] >= 0; }
+  // Why counters are missing, empty if none are.
+  const std::string &problem() const { return problems; }
+
+  // Counts since the counters were opened, scaled up for the time the group
+  // wasn't on the PMU if the kernel had to share it.
+  CounterValues read() const {
+    CounterValues values{};
+#if defined(__linux__)
+    for (size_t c = 0; c < fds.size(); c++) {
+      uint64_t data[3]; // value, time enabled, time running
+      if (fds[c] < 0 || ::read(fds[c], data, sizeof(data)) != sizeof(data))
+        continue;
+      values[c] = data[2] > 0 && data[2] < data[1]
+                      ? (uint64_t)((double)data[0] * data[1] / data[2])
+                      : data[0];
+    }
+#endif
+    return values;
+  }
+
+private:
+  void add_problem(const std::string &problem) {
+    problems += (problems.empty() ? "" : "; ") + problem;
+  }
+
+#if defined(__linux__)
+  static std::string explain(int error) {
+    switch (error) {
+    case EACCES:
+    case EPERM: {
+      std::string paranoid = "?";
+      std::ifstream("/proc/sys/kernel/perf_event_paranoid") >> paranoid;
+      return "not allowed, perf_event_paranoid is " + paranoid +
+             " and needs to be 2 or less (or CAP_PERFMON)";
+    }
+    case ENOENT:
+    case EOPNOTSUPP:
+    case EINVAL:
+      return "not supported by this CPU or virtual machine";
+    case ENOSYS:
+      return "the kernel has no perf_event_open";
+    default:
+      return std::strerror(error);
+    }
+  }
+#endif
+
+  std::array<int, (size_t)Counter::count> fds;
+  std::string problems;
+};
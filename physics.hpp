@@ -0,0 +1,267 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "parallel.hpp"
+
+inline double newton_law_of_universal_gravitation(
+    double gravitational_constant, double mass1, double mass2,
+    double distance_between_the_two_mass_centers) {
+  return gravitational_constant *
+         ((mass1 * mass2) / distance_between_the_two_mass_centers);
+}
+
+inline double magnitude(double x, double y, double z) {
+  return sqrt(x * x + y * y + z * z);
+}
+
+inline double distance(double x1, double y1, double z1, double x2, double y2,
+                       double z2) {
+  // We get the difference of the two points. Distance is just the magnitude of
+  // the difference a point to a other point
+  double x = (x1 - x2);
+  double y = (y1 - y2);
+  double z = (z1 - z2);
+
+  // Get the magnitude of difference
+  return magnitude(x, y, z);
+}
+
+// How the velocities are updated from the forces between every pair.
+enum class Solver {
+  pairwise, // every pair once, updating both bodies, on one thread
+  parallel  // every body sums the pull of all others, bodies split on threads
+};
+
+// What the parallel solver computes the pairs in. The bodies are always
+// stored as doubles.
+enum class Precision {
+  full,  // doubles throughout
+  mixed, // pair terms in float, their sums in double
+  single // floats throughout, twice the values per SIMD register
+};
+
+// Floating point operations counted per pair interaction when reporting
+// GFLOP/s, the usual convention for direct n-body codes.
+inline constexpr double flops_per_interaction = 20;
+
+// Pair interactions one force update of n bodies computes.
+inline double interactions_per_update(size_t n, Solver solver) {
+  const double pairs = (double)n * (n - 1) / 2;
+  return solver == Solver::parallel ? 2 * pairs : pairs;
+}
+
+// Potential energy of a pair for this force law. The force G m1 m2 / r is
+// minus the derivative of G m1 m2 ln r, so that's the potential, up to a
+// constant that cancels out of energy differences.
+inline double pair_potential(double gravitational_constant, double mass1,
+                             double mass2, double distance) {
+  return gravitational_constant * mass1 * mass2 * std::log(distance);
+}
+
+// Update the velocity of the bodies by acceleration using newton's law of
+// universal gravitation. With with_potential it also adds up and returns the
+// potential energy of the positions the forces come from, in the same pass
+// over the pairs, otherwise returns 0.
+template <bool with_potential = false>
+inline double accelerate_pairwise(Bodies &bodies,
+                                  const double gravitational_constant) {
+  double potential = 0;
+  // Only velocities are written here, so the positions and masses read are
+  // the unmodified ones and the result doesn't depend on the order of bodies
+  // in the array.
+
+  // Avoid bodies that already have calculations for each other by looping
+  // all combinations. Each calculation will update both bodies at the same
+  // time to not repeat the same calculations twice.
+  for (size_t i1 = 0, n = bodies.size(); i1 + 1 < n; i1++) {
+    for (size_t i2 = i1 + 1; i2 < n; i2++) {
+
+      // the mass centers will be the bodies' x, y, z members
+      const double distance_between_the_two_mass_centers =
+          distance(bodies.x[i1], bodies.y[i1], bodies.z[i1], bodies.x[i2],
+                   bodies.y[i2], bodies.z[i2]);
+
+      const double force = newton_law_of_universal_gravitation(
+          gravitational_constant, bodies.mass[i1], bodies.mass[i2],
+          distance_between_the_two_mass_centers);
+      if constexpr (with_potential)
+        potential += pair_potential(gravitational_constant, bodies.mass[i1],
+                                    bodies.mass[i2],
+                                    distance_between_the_two_mass_centers);
+
+      // Get the direction of the force for the first body
+      const double x1 = (bodies.x[i2] - bodies.x[i1]);
+      const double y1 = (bodies.y[i2] - bodies.y[i1]);
+      const double z1 = (bodies.z[i2] - bodies.z[i1]);
+
+      // Normalize the first force direction. The magnitude will be the
+      // force calculated by newton's law of universal gravitation
+      const double magnitude1 = magnitude(x1, y1, z1);
+      const double x1_normalized = x1 / magnitude1;
+      const double y1_normalized = y1 / magnitude1;
+      const double z1_normalized = z1 / magnitude1;
+
+      // Multiply by force to set the magnitude of the first force
+      // direction. Account for mass for final expression
+      const double x1_force = x1_normalized * force;
+      const double y1_force = y1_normalized * force;
+      const double z1_force = z1_normalized * force;
+
+      // The second force direction for the second body is just the opposite
+      // of the first
+      const double x2_force = -x1_force;
+      const double y2_force = -y1_force;
+      const double z2_force = -z1_force;
+
+      // Calculate and apply the acceleration to the velocity of the first
+      // body
+      bodies.vx[i1] += x1_force / bodies.mass[i1];
+      bodies.vy[i1] += y1_force / bodies.mass[i1];
+      bodies.vz[i1] += z1_force / bodies.mass[i1];
+
+      // Do do the same for the second body
+      bodies.vx[i2] += x2_force / bodies.mass[i2];
+      bodies.vy[i2] += y2_force / bodies.mass[i2];
+      bodies.vz[i2] += z2_force / bodies.mass[i2];
+    }
+  }
+  return potential;
+}
+
+// The same law, but every body adds up the pull of all the others by itself.
+// Twice the pair calculations of accelerate_pairwise, but bodies don't write
+// to each other so they can be split over threads, and the inner loop has no
+// stores so the compiler can vectorize it. The mass of the body cancels out
+// of force / mass. with_potential works as for accelerate_pairwise; every
+// pair is seen from both sides so each side adds half. Pair terms are
+// computed as Real and added up as Sum, see Precision; for float the
+// positions and masses are converted once first.
+template <bool with_potential = false, typename Real = double,
+          typename Sum = double>
+inline double accelerate_parallel(Bodies &bodies,
+                                  const double gravitational_constant) {
+  const size_t n = bodies.size();
+  std::array<const Real *, 4> columns;
+  std::array<std::vector<Real>, 4> converted;
+  const std::array<const Column *, 4> sources = {&bodies.x, &bodies.y,
+                                                 &bodies.z, &bodies.mass};
+  for (size_t c = 0; c < columns.size(); c++) {
+    if constexpr (std::is_same_v<Real, double>) {
+      columns[c] = sources[c]->data();
+    } else {
+      converted[c].assign(sources[c]->begin(), sources[c]->end());
+      columns[c] = converted[c].data();
+    }
+  }
+  const Real *x = columns[0], *y = columns[1], *z = columns[2],
+             *mass = columns[3];
+  const Real G = (Real)gravitational_constant;
+  // per chunk so the sum doesn't depend on which thread finishes first
+  std::vector<double> potentials(with_potential ? parallel_for_chunks(n, 16)
+                                                : 0);
+  parallel_for(
+      n,
+      [&](size_t begin, size_t end, unsigned chunk) {
+        [[maybe_unused]] double potential = 0;
+        for (size_t i = begin; i < end; i++) {
+          Sum ax = 0, ay = 0, az = 0, pull_potential = 0;
+          // two ranges instead of skipping i inside the loop
+          const auto pull = [&](size_t first, size_t last) {
+            for (size_t j = first; j < last; j++) {
+              const Real dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+              const Real distance_squared = dx * dx + dy * dy + dz * dz;
+              // G m / r along the unit direction d / r
+              const Real scale = G * mass[j] / distance_squared;
+              ax += dx * scale;
+              ay += dy * scale;
+              az += dz * scale;
+              // m ln r, as ln of the squared distance over 2
+              if constexpr (with_potential)
+                pull_potential += mass[j] * std::log(distance_squared);
+            }
+          };
+          pull(0, i);
+          pull(i + 1, n);
+          bodies.vx[i] += ax;
+          bodies.vy[i] += ay;
+          bodies.vz[i] += az;
+          if constexpr (with_potential)
+            potential += (double)mass[i] * pull_potential;
+        }
+        if constexpr (with_potential)
+          potentials[chunk] = potential;
+      },
+      16);
+  double potential = 0;
+  for (double chunk_potential : potentials)
+    potential += chunk_potential;
+  // halves for ln r from ln r^2 and for counting every pair twice
+  return gravitational_constant * potential / 4;
+}
+
+template <typename Real, typename Sum>
+inline double accelerate_parallel_in(Bodies &bodies,
+                                     double gravitational_constant,
+                                     bool with_potential) {
+  return with_potential ? accelerate_parallel<true, Real, Sum>(
+                              bodies, gravitational_constant)
+                        : accelerate_parallel<false, Real, Sum>(
+                              bodies, gravitational_constant);
+}
+
+// Returns the potential energy with with_potential, 0 otherwise. precision
+// only applies to the parallel solver.
+inline double accelerate(Bodies &bodies, double gravitational_constant,
+                         Solver solver, Precision precision = Precision::full,
+                         bool with_potential = false) {
+  if (solver == Solver::parallel) {
+    switch (precision) {
+    case Precision::single:
+      return accelerate_parallel_in<float, float>(
+          bodies, gravitational_constant, with_potential);
+    case Precision::mixed:
+      return accelerate_parallel_in<float, double>(
+          bodies, gravitational_constant, with_potential);
+    default:
+      return accelerate_parallel_in<double, double>(
+          bodies, gravitational_constant, with_potential);
+    }
+  }
+  return with_potential
+             ? accelerate_pairwise<true>(bodies, gravitational_constant)
+             : accelerate_pairwise(bodies, gravitational_constant);
+}
+
+// Update the position of the bodies by their velocity.
+inline void drift(Bodies &bodies) {
+  parallel_for(bodies.size(), [&](size_t begin, size_t end, unsigned) {
+    for (size_t i = begin; i < end; i++) {
+      bodies.x[i] += bodies.vx[i];
+      bodies.y[i] += bodies.vy[i];
+      bodies.z[i] += bodies.vz[i];
+    }
+  });
+}
+
+// Offset all bodies by the center point of bounds to make point (0, 0, 0) be
+// the center of all bodies, and the bounds with them.
+inline void recentre(Bodies &bodies, Bounds &bounds) {
+  const double cx = bounds.center_x();
+  const double cy = bounds.center_y();
+  const double cz = bounds.center_z();
+  parallel_for(bodies.size(), [&](size_t begin, size_t end, unsigned) {
+    for (size_t i = begin; i < end; i++) {
+      bodies.x[i] -= cx;
+      bodies.y[i] -= cy;
+      bodies.z[i] -= cz;
+    }
+  });
+  bounds.translate(-cx, -cy, -cz);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "body.hpp"
+#include "checkpoint.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "trajectory.hpp"
+
+// Plays back a stored run instead of simulating it: a trajectory, or a
+// checkpoint as a single frame. The playhead is a fractional stored step, in
+// between two steps positions and velocities are interpolated linearly so
+// slow motion stays smooth. Both neighbouring steps are kept decoded and the
+// chunks ahead of the playhead are prefetched from disk.
+class Player {
+public:
+  explicit Player(const std::string &path) {
+    std::array<char, 8> magic{};
+    {
+      const MappedFile file(path);
+      if (file.size() >= magic.size())
+        std::memcpy(magic.data(), file.data(), magic.size());
+    }
+    if (magic == TrajectoryHeader::expected_magic) {
+      trajectory = std::make_unique<TrajectoryReader>(path);
+      frame_count = trajectory->steps();
+      if (frame_count == 0)
+        throw std::runtime_error(path + " has no steps");
+      trajectory->mapped_file().advise(0, trajectory->mapped_file().size(),
+                                       MappedFile::Advice::sequential);
+    } else if (magic == CheckpointHeader::expected_magic) {
+      SimulationState state;
+      load_checkpoint(path, before, state);
+      after = before;
+      first_step = state.update_count;
+      frame_count = 1;
+      loaded = {0, 0};
+    } else {
+      throw std::runtime_error(path + " is not a trajectory or checkpoint");
+    }
+    interpolate();
+  }
+
+  // Number of stored steps.
+  uint64_t frames() const { return frame_count; }
+  double position() const { return playhead; }
+  bool at_end() const { return playhead >= frame_count - 1; }
+
+  // Update count of the simulation at the playhead.
+  uint64_t step() const {
+    const uint64_t frame = (uint64_t)playhead;
+    return trajectory ? trajectory->step_number(frame) : first_step;
+  }
+
+  // Move the playhead to a stored step, clamped to the run.
+  void seek(double frame) {
+    playhead = std::clamp(frame, 0.0, (double)(frame_count - 1));
+    interpolate();
+  }
+
+  // Move the playhead by speed stored steps, above 1 fast forwards, below 1
+  // is slow motion and negative plays backwards.
+  void advance(double speed) { seek(playhead + speed); }
+
+  // The bodies at the playhead.
+  const Bodies &bodies() const { return current; }
+
+private:
+  // Make sure the steps on both sides of the playhead are decoded, then blend
+  // them into current.
+  void interpolate() {
+    const uint64_t frame = (uint64_t)playhead;
+    const uint64_t next = std::min(frame + 1, frame_count - 1);
+    if (trajectory) {
+      // playing forward the step after becomes the step before, only one new
+      // step has to be read
+      if (loaded[1] == frame && loaded[1] != loaded[0]) {
+        std::swap(before, after);
+        loaded[0] = frame;
+        loaded[1] = (uint64_t)-1;
+      }
+      if (loaded[0] != frame) {
+        trajectory->read(frame, before);
+        loaded[0] = frame;
+      }
+      if (loaded[1] != next) {
+        trajectory->read(next, after);
+        loaded[1] = next;
+      }
+      trajectory->prefetch(next, chunks_ahead);
+    }
+
+    const double t = playhead - frame;
+    const size_t n = before.size();
+    current.resize(n);
+    const auto from = columns_of(std::as_const(before));
+    const auto to = columns_of(std::as_const(after));
+    const auto into = columns_of(current);
+    parallel_for(n, [&](size_t begin, size_t end, unsigned) {
+      for (size_t c = 0; c < into.size(); c++) {
+        const double *a = from[c]->data(), *b = to[c]->data();
+        double *out = into[c]->data();
+        for (size_t i = begin; i < end; i++)
+          out[i] = a[i] + (b[i] - a[i]) * t;
+      }
+    });
+  }
+
+  static constexpr size_t chunks_ahead = 2;
+
+  std::unique_ptr<TrajectoryReader> trajectory;
+  uint64_t frame_count = 0;
+  uint64_t first_step = 0; // of a checkpoint
+  double playhead = 0;
+  Bodies before, after, current;
+  std::array<uint64_t, 2> loaded = {(uint64_t)-1, (uint64_t)-1};
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "checkpoint.hpp"
+#include "parallel.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// A lossy snapshot encoding. Every column is stored as fixed point numbers
+// relative to its range in this step: value = middle + q * step with q a
+// signed 16, 21 or 32 bit integer, picked per column as the fewest bits that
+// keep every value within the error bound. 21 bit values are packed 3 to a
+// 64 bit word. A column whose range needs more than 32 bits, and the mass,
+// are kept as doubles (64 bits). With a time step of 1 a velocity error of E
+// moves a body by E per update, so one bound in length units fits both.
+//
+//   QuantizedHeader
+//   7 columns, x, y, z, vx, vy, vz and mass, each at its offset
+struct QuantizedColumn {
+  uint32_t bits = 64;
+  uint32_t reserved = 0;
+  double middle = 0;
+  double step = 0;
+  uint64_t offset = 0; // from the start of the snapshot
+  uint64_t size = 0;   // in bytes
+};
+
+struct QuantizedHeader {
+  static constexpr std::array<char, 8> expected_magic = {'N', 'B', 'O', 'D',
+                                                         'Y', 'Q', 'N', 'T'};
+  static constexpr uint32_t current_version = 1;
+
+  std::array<char, 8> magic = expected_magic;
+  uint32_t version = current_version;
+  uint32_t endian = CheckpointHeader::native_endian;
+  uint64_t number_of_bodies = 0;
+  uint64_t step = 0;
+  double error = 0; // largest difference between a value and its encoding
+  uint64_t reserved = 0;
+  std::array<QuantizedColumn, CheckpointHeader::columns> columns{};
+};
+
+// Bytes n values take at bits per value.
+inline size_t quantized_size(size_t n, uint32_t bits) {
+  switch (bits) {
+  case 16:
+    return n * 2;
+  case 21:
+    return (n + 2) / 3 * 8;
+  case 32:
+    return n * 4;
+  default:
+    return n * 8;
+  }
+}
+
+// The fewest bits that keep values between lowest and highest within error
+// of themselves, and the step between two fixed point numbers.
+inline uint32_t quantized_bits(double lowest, double highest, double error,
+                               double &step) {
+  const double extent = highest - lowest;
+  for (uint32_t bits : {16u, 21u, 32u}) {
+    // q from -(2^(bits-1) - 1) to 2^(bits-1) - 1
+    step = extent / (std::ldexp(1.0, bits) - 2);
+    if (step / 2 <= error)
+      return bits;
+  }
+  step = 0;
+  return 64;
+}
+
+// q = round((value - middle) / step) for count values. Converts 4 or 2 values
+// at once where the compiler targets SIMD, rounding to nearest.
+inline void to_fixed_point(const double *values, size_t count, double middle,
+                           double inverse_step, int32_t *q) {
+  size_t i = 0;
+#if defined(__AVX__)
+  const __m256d m = _mm256_set1_pd(middle), s = _mm256_set1_pd(inverse_step);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d scaled =
+        _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(values + i), m), s);
+    _mm_storeu_si128((__m128i *)(q + i), _mm256_cvtpd_epi32(scaled));
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  const __m128d m = _mm_set1_pd(middle), s = _mm_set1_pd(inverse_step);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d scaled = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(values + i), m), s);
+    _mm_storel_epi64((__m128i *)(q + i), _mm_cvtpd_epi32(scaled));
+  }
+#endif
+  for (; i < count; i++)
+    q[i] = (int32_t)std::lrint((values[i] - middle) * inverse_step);
+}
+
+// value = middle + q * step, the other way around.
+inline void from_fixed_point(const int32_t *q, size_t count, double middle,
+                             double step, double *values) {
+  size_t i = 0;
+#if defined(__AVX__)
+  const __m256d m = _mm256_set1_pd(middle), s = _mm256_set1_pd(step);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d v =
+        _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(q + i)));
+    _mm256_storeu_pd(values + i, _mm256_add_pd(_mm256_mul_pd(v, s), m));
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  const __m128d m = _mm_set1_pd(middle), s = _mm_set1_pd(step);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d v = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i *)(q + i)));
+    _mm_storeu_pd(values + i, _mm_add_pd(_mm_mul_pd(v, s), m));
+  }
+#endif
+  for (; i < count; i++)
+    values[i] = middle + q[i] * step;
+}
+
+// Blocks of values are converted through a small fixed point buffer, a
+// multiple of 3 so packed 21 bit words never straddle two blocks.
+inline constexpr size_t quantize_block = 3 * 1024;
+
+inline void quantize_column(const double *values, size_t n,
+                            const QuantizedColumn &column, uint8_t *out) {
+  if (column.bits == 64) {
+    std::memcpy(out, values, n * sizeof(double));
+    return;
+  }
+  const double inverse_step = column.step > 0 ? 1 / column.step : 0;
+  const size_t blocks = (n + quantize_block - 1) / quantize_block;
+  parallel_for(
+      blocks,
+      [&](size_t first, size_t last, unsigned) {
+        std::array<int32_t, quantize_block> q;
+        for (size_t block = first; block < last; block++) {
+          const size_t begin = block * quantize_block;
+          const size_t count = std::min(quantize_block, n - begin);
+          to_fixed_point(values + begin, count, column.middle, inverse_step,
+                         q.data());
+          if (column.bits == 16) {
+            int16_t *packed = (int16_t *)out + begin;
+            for (size_t i = 0; i < count; i++)
+              packed[i] = (int16_t)q[i];
+          } else if (column.bits == 32) {
+            std::memcpy((int32_t *)out + begin, q.data(),
+                        count * sizeof(int32_t));
+          } else {
+            uint64_t *packed = (uint64_t *)out + begin / 3;
+            constexpr uint64_t mask = (1u << 21) - 1;
+            for (size_t i = 0; i < count; i += 3) {
+              uint64_t word = (uint64_t)q[i] & mask;
+              if (i + 1 < count)
+                word |= ((uint64_t)q[i + 1] & mask) << 21;
+              if (i + 2 < count)
+                word |= ((uint64_t)q[i + 2] & mask) << 42;
+              packed[i / 3] = word;
+            }
+          }
+        }
+      },
+      1);
+}
+
+inline void dequantize_column(const uint8_t *in, size_t n,
+                              const QuantizedColumn &column, double *values) {
+  if (column.bits == 64) {
+    std::memcpy(values, in, n * sizeof(double));
+    return;
+  }
+  const size_t blocks = (n + quantize_block - 1) / quantize_block;
+  parallel_for(
+      blocks,
+      [&](size_t first, size_t last, unsigned) {
+        std::array<int32_t, quantize_block> q;
+        for (size_t block = first; block < last; block++) {
+          const size_t begin = block * quantize_block;
+          const size_t count = std::min(quantize_block, n - begin);
+          if (column.bits == 16) {
+            int16_t packed[quantize_block];
+            std::memcpy(packed, in + begin * 2, count * 2);
+            for (size_t i = 0; i < count; i++)
+              q[i] = packed[i];
+          } else if (column.bits == 32) {
+            std::memcpy(q.data(), in + begin * 4, count * 4);
+          } else {
+            for (size_t i = 0; i < count; i += 3) {
+              uint64_t word;
+              std::memcpy(&word, in + (begin + i) / 3 * 8, 8);
+              // shift each 21 bit field to the top and back to sign extend
+              for (size_t k = 0; k < 3 && i + k < count; k++)
+                q[i + k] = (int32_t)((int64_t)(word << (43 - 21 * k)) >> 43);
+            }
+          }
+          from_fixed_point(q.data(), count, column.middle, column.step,
+                           values + begin);
+        }
+      },
+      1);
+}
+
+// Lowest and highest value of a column in one parallel sweep.
+inline void column_range(const Column &column, double &lowest,
+                         double &highest) {
+  constexpr size_t block_size = 16384;
+  const size_t n = column.size();
+  const size_t blocks = (n + block_size - 1) / block_size;
+  std::vector<std::array<double, 3>> ranges(
+      blocks, {std::numeric_limits<double>::infinity(),
+               -std::numeric_limits<double>::infinity(), 0});
+  parallel_for(
+      blocks,
+      [&](size_t first, size_t last, unsigned) {
+        for (size_t block = first; block < last; block++)
+          column_bounds(column.data(), block * block_size,
+                        std::min(n, (block + 1) * block_size), ranges[block][0],
+                        ranges[block][1], ranges[block][2]);
+      },
+      1);
+  lowest = std::numeric_limits<double>::infinity();
+  highest = -std::numeric_limits<double>::infinity();
+  for (const auto &range : ranges) {
+    lowest = std::min(lowest, range[0]);
+    highest = std::max(highest, range[1]);
+  }
+}
+
+// Encode the bodies of a step with every position and velocity within error.
+inline std::vector<uint8_t> encode_quantized(const Bodies &bodies,
+                                             uint64_t step, double error) {
+  QuantizedHeader header;
+  header.number_of_bodies = bodies.size();
+  header.step = step;
+  header.error = error;
+
+  const auto columns = columns_of(bodies);
+  uint64_t offset = sizeof(header);
+  for (size_t c = 0; c < columns.size(); c++) {
+    QuantizedColumn &column = header.columns[c];
+    if (c + 1 < columns.size() && bodies.size() > 0) {
+      double lowest, highest;
+      column_range(*columns[c], lowest, highest);
+      column.bits = quantized_bits(lowest, highest, error, column.step);
+      column.middle = (lowest + highest) / 2;
+    }
+    // keep every column 8 byte aligned
+    offset = (offset + 7) / 8 * 8;
+    column.offset = offset;
+    column.size = quantized_size(bodies.size(), column.bits);
+    offset += column.size;
+  }
+
+  std::vector<uint8_t> data(offset);
+  std::memcpy(data.data(), &header, sizeof(header));
+  for (size_t c = 0; c < columns.size(); c++)
+    quantize_column(columns[c]->data(), bodies.size(), header.columns[c],
+                    data.data() + header.columns[c].offset);
+  return data;
+}
+
+// Decode a quantized snapshot into bodies. Throws std::runtime_error.
+inline uint64_t decode_quantized(const uint8_t *data, size_t size,
+                                 Bodies &bodies) {
+  QuantizedHeader header;
+  if (size < sizeof(header))
+    throw std::runtime_error("too small to be a quantized snapshot");
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic != QuantizedHeader::expected_magic)
+    throw std::runtime_error("not a quantized snapshot");
+  if (header.endian != CheckpointHeader::native_endian)
+    throw std::runtime_error("quantized snapshot has another byte order");
+  if (header.version != QuantizedHeader::current_version)
+    throw std::runtime_error("unsupported quantized snapshot version");
+  for (const QuantizedColumn &column : header.columns) {
+    if ((column.bits != 16 && column.bits != 21 && column.bits != 32 &&
+         column.bits != 64) ||
+        column.size != quantized_size(header.number_of_bodies, column.bits) ||
+        column.offset + column.size > size)
+      throw std::runtime_error("quantized snapshot is truncated");
+  }
+
+  bodies.resize(header.number_of_bodies);
+  const auto columns = columns_of(bodies);
+  for (size_t c = 0; c < columns.size(); c++)
+    dequantize_column(data + header.columns[c].offset, bodies.size(),
+                      header.columns[c], columns[c]->data());
+  return header.step;
+}
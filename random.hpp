@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3"). A counter based generator: the output is a pure function of a 128 bit
+// counter and a 64 bit key, so any random number can be made directly,
+// without generating the ones before it and without shared state between
+// threads.
+inline std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> counter,
+                                          std::array<uint32_t, 2> key) {
+  constexpr uint32_t multiplier0 = 0xD2511F53, multiplier1 = 0xCD9E8D57;
+  constexpr uint32_t weyl0 = 0x9E3779B9, weyl1 = 0xBB67AE85;
+  for (int round = 0; round < 10; round++) {
+    const uint64_t product0 = (uint64_t)multiplier0 * counter[0];
+    const uint64_t product1 = (uint64_t)multiplier1 * counter[2];
+    counter = {(uint32_t)(product1 >> 32) ^ counter[1] ^ key[0],
+               (uint32_t)product1,
+               (uint32_t)(product0 >> 32) ^ counter[3] ^ key[1],
+               (uint32_t)product0};
+    key[0] += weyl0;
+    key[1] += weyl1;
+  }
+  return counter;
+}
+
+// A stream of random numbers identified by a seed and a stream number, e.g.
+// the index of a body. The numbers a body gets only depend on the seed and
+// its index, never on which thread made them or in what order, so any number
+// of threads gives the same bodies.
+class RandomStream {
+public:
+  RandomStream(uint64_t seed, uint64_t stream)
+      : key{(uint32_t)seed, (uint32_t)(seed >> 32)},
+        stream{(uint32_t)stream, (uint32_t)(stream >> 32)} {}
+
+  uint32_t next_uint32() {
+    if (used == block.size()) {
+      block = philox4x32({stream[0], stream[1], (uint32_t)counter,
+                          (uint32_t)(counter >> 32)},
+                         key);
+      counter++;
+      used = 0;
+    }
+    return block[used++];
+  }
+
+  // Uniform in [0, 1) with all 53 bits of a double.
+  double uniform() {
+    const uint64_t high = next_uint32() >> 5; // 27 bits
+    const uint64_t low = next_uint32() >> 6;  // 26 bits
+    return (high * 67108864.0 + low) * (1.0 / 9007199254740992.0);
+  }
+
+  // Uniform in [low, high).
+  double uniform(double low, double high) {
+    return low + (high - low) * uniform();
+  }
+
+  // Standard normal by Box-Muller.
+  double normal() {
+    const double u1 = 1 - uniform(); // (0, 1] so the log is finite
+    const double u2 = uniform();
+    return std::sqrt(-2 * std::log(u1)) *
+           std::cos(2 * std::numbers::pi * u2);
+  }
+
+private:
+  std::array<uint32_t, 2> key;
+  std::array<uint32_t, 2> stream;
+  uint64_t counter = 0;
+  std::array<uint32_t, 4> block{};
+  size_t used = block.size();
+};
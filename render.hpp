@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "body.hpp"
+#include "bounds.hpp"
+#include "parallel.hpp"
+
+// How the bodies are drawn to the console.
+enum class RenderMode {
+  map,           // one glyph per body, the glyph shows z, last body wins
+  density,       // glyph ramp by how much is in each cell
+  density_colour // 256-colour ANSI by how much is in each cell
+};
+
+// What a cell of the density map adds up.
+enum class DensityWeight { count, mass };
+
+// set the characters to be used to represent the z position of bodies or the
+// density of a cell. the lowest value will have the smallest character and
+// the highest value will have the biggest character.
+inline constexpr std::array map_characters = {
+    '.', '\'', ':', '-', '_', '^', '+', '=',
+    '~', '*',  'o', 'O', '#', '%', '&', '@'};
+
+// 256-colour ANSI palette going from dark blue through green and yellow to
+// red. Used for the colour density map.
+inline constexpr std::array density_colours = {
+    17, 18, 19, 20, 21, 27, 33, 39, 45, 51, 50, 49,
+    48, 47, 46, 82, 118, 154, 190, 226, 220, 214, 208, 202, 196};
+
+// Create a string of a map of the bodies relative to each other.
+// Need more than two bodies to be useful
+// Comment out z cause only x and y is accounted for now.
+inline std::string create_map_of_bodies(const uint height, const uint width,
+                                        const Bodies &bodies,
+                                        const Bounds &bounds) {
+  uint z_size = map_characters.size();
+
+  std::vector<std::string> lines{height, std::string(width, ' ')};
+  for (size_t i = 0; i < bodies.size(); i++) {
+    // get map positon of body by inverse lerp using bounds
+    const double x_t = (bodies.x[i] - bounds.lowest_x) /
+                       (bounds.highest_x - bounds.lowest_x);
+    const double y_t = (bodies.y[i] - bounds.lowest_y) /
+                       (bounds.highest_y - bounds.lowest_y);
+    const double z_t = (bodies.z[i] - bounds.lowest_z) /
+                       (bounds.highest_z - bounds.lowest_z);
+
+    // the camera may not show every body
+    if (!(x_t >= 0 && x_t <= 1 && y_t >= 0 && y_t <= 1))
+      continue;
+
+    const uint x = round(x_t * (width - 1));
+    const uint y = round(y_t * (height - 1));
+    const uint z = round(std::clamp(z_t, 0.0, 1.0) * (z_size - 1));
+
+    lines[y][x] = map_characters[z];
+  }
+
+  std::string output = "";
+  // append all lines to output
+  for (std::string const &line : lines) {
+    output += line + '\n';
+  }
+
+  return output;
+}
+
+// Counts or masses of a grid of cells, row by row, charged to render memory.
+using Histogram = TrackedVector<double, Subsystem::render>;
+
+// Add up the count or mass of bodies into a height by width grid. cell_of
+// maps a body's index to its cell index or returns false to leave it out. Every
+// thread fills its own histogram so there are no atomics, then the histograms
+// are summed cell by cell, also in parallel. O(N + threads * cells).
+template <typename CellOf>
+Histogram accumulate_histogram(const uint height, const uint width,
+                               const Bodies &bodies, const DensityWeight weight,
+                               CellOf cell_of) {
+  const size_t cells = (size_t)height * width;
+  const unsigned chunks = parallel_for_chunks(bodies.size());
+  Histogram histograms((size_t)chunks * cells, 0);
+
+  parallel_for(bodies.size(), [&](size_t begin, size_t end, unsigned thread) {
+    double *histogram = histograms.data() + thread * cells;
+    for (size_t i = begin; i < end; i++) {
+      size_t cell;
+      if (!cell_of(i, cell))
+        continue;
+      histogram[cell] += weight == DensityWeight::mass ? bodies.mass[i] : 1;
+    }
+  });
+
+  // The first histogram is the total, add every other one onto it.
+  if (chunks > 1) {
+    parallel_for(cells, [&](size_t begin, size_t end, unsigned) {
+      for (unsigned t = 1; t < chunks; t++) {
+        const double *histogram = histograms.data() + t * cells;
+        for (size_t i = begin; i < end; i++)
+          histograms[i] += histogram[i];
+      }
+    });
+  }
+  histograms.resize(cells);
+  return histograms;
+}
+
+// Add up the count or mass of bodies in every cell of a height by width grid
+// spanning the bounds of the bodies.
+inline Histogram
+create_density_histogram(const uint height, const uint width,
+                         const Bodies &bodies, const Bounds &bounds,
+                         const DensityWeight weight) {
+  // Scale from position to cell. Zero when every body is on the same line so
+  // they all land in the first cell instead of dividing by zero.
+  const double x_scale = bounds.highest_x > bounds.lowest_x
+                             ? (width - 1) / (bounds.highest_x - bounds.lowest_x)
+                             : 0;
+  const double y_scale = bounds.highest_y > bounds.lowest_y
+                             ? (height - 1) / (bounds.highest_y - bounds.lowest_y)
+                             : 0;
+
+  return accumulate_histogram(
+      height, width, bodies, weight, [&](size_t i, size_t &cell) {
+        const double x = std::round((bodies.x[i] - bounds.lowest_x) * x_scale);
+        const double y = std::round((bodies.y[i] - bounds.lowest_y) * y_scale);
+        // the camera may not show every body
+        if (!(x >= 0 && x < width && y >= 0 && y < height))
+          return false;
+        cell = (size_t)y * width + (size_t)x;
+        return true;
+      });
+}
+
+// Create a string of a map where every cell shows how much is in it instead
+// of just the last body drawn there. Density is log scaled so a dense core
+// doesn't wash out everything else. With colour the cell is a block in a
+// 256-colour ANSI palette, without it the cell is a glyph from the ramp.
+inline std::string create_density_map_of_bodies(const uint height,
+                                                const uint width,
+                                                const Bodies &bodies,
+                                                const Bounds &bounds,
+                                                const DensityWeight weight,
+                                                const bool colour) {
+  const Histogram histogram =
+      create_density_histogram(height, width, bodies, bounds, weight);
+
+  const double highest_density =
+      *std::max_element(histogram.begin(), histogram.end());
+  const double log_highest_density = std::log1p(highest_density);
+
+  // Map a cell's density into [0, levels - 1]. Any non empty cell gets at
+  // least the lowest level so lone bodies are still visible.
+  const auto level = [&](double density, size_t levels) -> size_t {
+    if (log_highest_density <= 0)
+      return 0;
+    const double t = std::log1p(density) / log_highest_density;
+    return std::min(levels - 1, (size_t)(t * (levels - 1) + 0.5));
+  };
+
+  std::string output;
+  // each colour change is at most 11 bytes of escape sequence
+  output.reserve(histogram.size() * (colour ? 12 : 1) + height * 5);
+  for (uint y = 0; y < height; y++) {
+    int current_colour = -1;
+    for (uint x = 0; x < width; x++) {
+      const double density = histogram[(size_t)y * width + x];
+      if (density <= 0) {
+        output += ' ';
+        continue;
+      }
+      if (!colour) {
+        output += map_characters[level(density, map_characters.size())];
+        continue;
+      }
+      const int cell_colour =
+          density_colours[level(density, density_colours.size())];
+      if (cell_colour != current_colour) {
+        output += "\033[38;5;" + std::to_string(cell_colour) + 'm';
+        current_colour = cell_colour;
+      }
+      output += '#';
+    }
+    if (current_colour != -1)
+      output += "\033[0m";
+    output += '\n';
+  }
+
+  return output;
+}
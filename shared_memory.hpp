@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "body.hpp"
+#include "checkpoint.hpp"
+#include "parallel.hpp"
+
+#if !defined(_WIN32)
+#include <cerrno>
+
+#include "nbody_shm.h"
+#endif
+
+// Publishes a snapshot of the bodies every update into POSIX shared memory
+// that other processes map read only, see nbody_shm.h for the layout and a
+// reader. Publishing is a copy into the next slot of a ring guarded by a
+// seqlock, it never waits for readers, a reader that falls behind just reads
+// a newer slot. The region is removed again when the publisher goes away.
+class SnapshotPublisher {
+public:
+#if defined(_WIN32)
+  SnapshotPublisher(const std::string &, size_t, uint, double) {
+    throw std::runtime_error("shared memory snapshots need POSIX");
+  }
+  void publish(const Bodies &, const SimulationState &) {}
+#else
+  SnapshotPublisher(std::string name, size_t number_of_bodies, uint slots,
+                    double gravitational_constant)
+      : name(std::move(name)) {
+    if (this->name.empty() || this->name[0] != '/')
+      this->name = "/" + this->name;
+    if (slots < 2)
+      throw std::invalid_argument("need at least 2 shared memory slots");
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const auto align = [](size_t size, size_t alignment) {
+      return (size + alignment - 1) / alignment * alignment;
+    };
+    const size_t column_size = align(number_of_bodies * sizeof(double), 64);
+    const size_t first_column = align(sizeof(nbody_shm_slot), 64);
+    const size_t slot_size =
+        align(first_column + NBODY_SHM_COLUMNS * column_size, page);
+    const size_t slots_offset = align(sizeof(nbody_shm_header), page);
+    size = slots_offset + slots * slot_size;
+
+    int fd = shm_open(this->name.c_str(), O_CREAT | O_RDWR, 0644);
+    // A region left over from an earlier run with another size can't be
+    // resized under readers that still map it, they would get SIGBUS. Unlink
+    // it so they keep the old one and make a new one.
+    struct stat status;
+    if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size != 0 &&
+        (size_t)status.st_size != size) {
+      ::close(fd);
+      shm_unlink(this->name.c_str());
+      fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0)
+      throw std::runtime_error("can't create shared memory " + this->name +
+                               ": " + std::strerror(errno));
+    if (ftruncate(fd, (off_t)size) != 0) {
+      const int error = errno;
+      ::close(fd);
+      shm_unlink(this->name.c_str());
+      throw std::runtime_error("can't size shared memory " + this->name +
+                               ": " + std::strerror(error));
+    }
+    address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+      const int error = errno;
+      shm_unlink(this->name.c_str());
+      throw std::runtime_error("can't map shared memory " + this->name + ": " +
+                               std::strerror(error));
+    }
+
+    // A region of the same size left over from an earlier run may be mapped
+    // by readers, so take it over without ever showing them a half written
+    // header: the magic goes last.
+    header = (nbody_shm_header *)address;
+    std::atomic_ref<uint64_t>(header->magic).store(0, std::memory_order_relaxed);
+    std::atomic_ref<uint64_t>(header->published)
+        .store(0, std::memory_order_relaxed);
+    header->version = NBODY_SHM_VERSION;
+    header->slot_count = slots;
+    header->number_of_bodies = number_of_bodies;
+    header->slot_size = slot_size;
+    header->slots_offset = slots_offset;
+    header->gravitational_constant = gravitational_constant;
+    for (uint s = 0; s < slots; s++) {
+      nbody_shm_slot *slot = slot_at(s);
+      std::atomic_ref<uint64_t>(slot->sequence)
+          .store(0, std::memory_order_relaxed);
+      for (size_t c = 0; c < NBODY_SHM_COLUMNS; c++)
+        slot->column_offsets[c] = first_column + c * column_size;
+    }
+    std::atomic_ref<uint64_t>(header->magic)
+        .store(NBODY_SHM_MAGIC, std::memory_order_release);
+  }
+
+  SnapshotPublisher(const SnapshotPublisher &) = delete;
+  SnapshotPublisher &operator=(const SnapshotPublisher &) = delete;
+
+  ~SnapshotPublisher() {
+    munmap(address, size);
+    shm_unlink(name.c_str());
+  }
+
+  void publish(const Bodies &bodies, const SimulationState &state) {
+    if (bodies.size() != header->number_of_bodies)
+      throw std::runtime_error("number of bodies changed under " + name);
+    nbody_shm_slot *slot = slot_at(header->published % header->slot_count);
+    std::atomic_ref<uint64_t> sequence(slot->sequence);
+
+    // odd while writing, readers that see it or see it change start over
+    const uint64_t start = sequence.load(std::memory_order_relaxed) + 1;
+    sequence.store(start, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->step = state.update_count;
+    slot->time = state.time();
+    const auto columns = columns_of(bodies);
+    parallel_for(bodies.size(), [&](size_t begin, size_t end, unsigned) {
+      for (size_t c = 0; c < columns.size(); c++)
+        std::memcpy((char *)slot + slot->column_offsets[c] +
+                        begin * sizeof(double),
+                    columns[c]->data() + begin,
+                    (end - begin) * sizeof(double));
+    });
+
+    sequence.store(start + 1, std::memory_order_release);
+    std::atomic_ref<uint64_t>(header->published)
+        .store(header->published + 1, std::memory_order_release);
+  }
+
+private:
+  nbody_shm_slot *slot_at(uint64_t slot) {
+    return (nbody_shm_slot *)((char *)address + header->slots_offset +
+                              slot * header->slot_size);
+  }
+
+  std::string name;
+  void *address = nullptr;
+  size_t size = 0;
+  nbody_shm_header *header = nullptr;
+#endif
+};
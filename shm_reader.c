@@ -0,0 +1,54 @@
+/* Reads the newest snapshot a running simulation publishes with --shm NAME
+ * and prints its update count and centre of mass, an example of using
+ * nbody_shm.h from C.
+ *
+ *   nbody_shm_reader /nbody */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nbody_shm.h"
+
+int main(int argc, char **argv) {
+  struct nbody_shm_reader reader;
+  double *columns[NBODY_SHM_COLUMNS] = {0};
+  double mass = 0, centre[3] = {0, 0, 0};
+  uint64_t step = 0;
+  size_t n, i;
+  int c, result;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: nbody_shm_reader NAME\n");
+    return 1;
+  }
+  if (nbody_shm_open(&reader, argv[1]) != 0) {
+    fprintf(stderr, "no snapshots published under %s\n", argv[1]);
+    return 1;
+  }
+
+  /* x, y, z and mass */
+  n = reader.header->number_of_bodies;
+  for (c = 0; c < NBODY_SHM_COLUMNS; c++)
+    if (c < 3 || c == 6)
+      columns[c] = malloc((n ? n : 1) * sizeof(double));
+  result = nbody_shm_read_latest(&reader, columns, &step);
+  if (result == 0) {
+    for (i = 0; i < n; i++) {
+      mass += columns[6][i];
+      for (c = 0; c < 3; c++)
+        centre[c] += columns[6][i] * columns[c][i];
+    }
+    for (c = 0; c < 3; c++)
+      centre[c] /= mass > 0 ? mass : 1;
+    printf("update %llu, %zu bodies, centre of mass %g %g %g\n",
+           (unsigned long long)step, n, centre[0], centre[1], centre[2]);
+  } else {
+    fprintf(stderr, result > 0 ? "nothing published yet\n"
+                               : "no consistent snapshot, the writer is too "
+                                 "fast\n");
+  }
+
+  for (c = 0; c < NBODY_SHM_COLUMNS; c++)
+    free(columns[c]);
+  nbody_shm_close(&reader);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "body.hpp"
+#include "checkpoint.hpp"
+#include "filter.hpp"
+#include "parallel.hpp"
+#include "quantize.hpp"
+
+// Writes the bodies an OutputFilter picks as numbered files in a directory:
+// snapshot_000123.bin in the raw column format --load reads, or with an error
+// bound the smaller, lossy snapshot_000123.nbq (see quantize.hpp), and with
+// any filter but all a snapshot_000123.ids next to it with the id of every
+// body as uint64. The filter runs on the update thread and gathers the picked
+// bodies, the file is written on a background thread. If the last snapshot is
+// still being written the new one is skipped rather than queued.
+class SnapshotWriter {
+public:
+  // error 0 writes exact doubles.
+  SnapshotWriter(std::string directory, OutputFilter filter, double error = 0)
+      : directory(std::move(directory)), selector(filter), error(error),
+        writer(1) {
+    std::filesystem::create_directories(this->directory);
+  }
+
+  // False when skipped because the previous snapshot isn't done.
+  bool write(const Bodies &bodies, uint64_t step) {
+    if (writer.pending() > 0) {
+      skipped_snapshots++;
+      return false;
+    }
+    MemoryScope scope(Subsystem::io);
+    auto selected = std::make_shared<Bodies>();
+    const std::vector<uint64_t> &chosen = selector.gather(bodies, *selected);
+    std::shared_ptr<const std::vector<uint64_t>> ids;
+    if (selector.output_filter().kind != OutputFilter::Kind::all)
+      ids = std::make_shared<const std::vector<uint64_t>>(chosen);
+
+    writer.submit([this, selected, ids, step] {
+      const std::string path = std::format("{}/snapshot_{:06}", directory, step);
+      bool ok;
+      if (error > 0) {
+        const std::vector<uint8_t> encoded =
+            encode_quantized(*selected, step, error);
+        ok = write_file(path + ".nbq", [&](std::FILE *file) {
+          return std::fwrite(encoded.data(), 1, encoded.size(), file) ==
+                 encoded.size();
+        });
+      } else {
+        ok = write_file(path + ".bin", [&](std::FILE *file) {
+          for (const Column *column : columns_of(std::as_const(*selected)))
+            if (std::fwrite(column->data(), sizeof(double), column->size(),
+                            file) != column->size())
+              return false;
+          return true;
+        });
+      }
+      if (ids)
+        ok = write_file(path + ".ids", [&](std::FILE *file) {
+               return std::fwrite(ids->data(), sizeof(uint64_t), ids->size(),
+                                  file) == ids->size();
+             }) && ok;
+      if (!ok)
+        failed_snapshots++;
+    });
+    return true;
+  }
+
+  uint failures() const { return failed_snapshots; }
+  uint skipped() const { return skipped_snapshots; }
+
+private:
+  template <typename WriteContent>
+  static bool write_file(const std::string &path, WriteContent write_content) {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      return false;
+    const bool ok = write_content(file);
+    return std::fclose(file) == 0 && ok;
+  }
+
+  std::string directory;
+  OutputSelector selector; // only used on the update thread
+  double error;
+  std::atomic<uint> failed_snapshots = 0;
+  std::atomic<uint> skipped_snapshots = 0;
+  ThreadPool writer; // last so the snapshot being written finishes first
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <format>
+#include <string>
+
+#include "body.hpp"
+#include "perf_counters.hpp"
+#include "physics.hpp"
+#include "trace.hpp"
+
+// Phases of an update that are timed separately.
+enum class Phase : uint {
+  map,      // drawing the console map
+  render,   // images and video frames
+  drift,    // moving bodies by their velocity
+  bounds,   // the bounds sweep
+  console,  // handing the frame to the console writer
+  force,    // the force loop
+  recentre, // moving everything back around (0, 0, 0)
+  output,   // checkpoints, trajectory, snapshots and shared memory
+  count
+};
+
+inline constexpr std::array<const char *, (size_t)Phase::count> phase_names = {
+    "map",     "render", "drift",    "bounds",
+    "console", "force",  "recentre", "output"};
+
+// Durations of one phase: count, total, extremes and a histogram with a
+// bucket per bit length of the nanoseconds, enough for percentiles within a factor
+// of 2 at the cost of an increment.
+struct PhaseHistogram {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t lowest_ns = UINT64_MAX;
+  uint64_t highest_ns = 0;
+  std::array<uint64_t, 65> buckets{};
+
+  void add(uint64_t ns) {
+    count++;
+    total_ns += ns;
+    lowest_ns = std::min(lowest_ns, ns);
+    highest_ns = std::max(highest_ns, ns);
+    buckets[std::bit_width(ns)]++;
+  }
+
+  double mean_ns() const { return count ? (double)total_ns / count : 0; }
+
+  // Upper edge of the bucket holding percentile p (0 to 100), capped at the
+  // longest duration seen.
+  uint64_t percentile_ns(double p) const {
+    const uint64_t rank = (uint64_t)(p / 100 * count);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+      seen += buckets[bucket];
+      if (seen > rank)
+        return bucket >= 64 ? highest_ns
+                            : std::min(highest_ns, ((uint64_t)1 << bucket) - 1);
+    }
+    return highest_ns;
+  }
+};
+
+inline std::string format_duration(double ns) {
+  if (ns >= 1e9)
+    return std::format("{:.2f}s", ns / 1e9);
+  if (ns >= 1e6)
+    return std::format("{:.1f}ms", ns / 1e6);
+  if (ns >= 1e3)
+    return std::format("{:.0f}us", ns / 1e3);
+  return std::format("{:.0f}ns", ns);
+}
+
+// Times every phase of every update, for a running summary and a report at
+// the end. Only the update thread records. Build with NBODY_NO_TIMERS to
+// compile every timer away.
+class PhaseTimers {
+public:
+  void record(Phase phase, uint64_t ns) {
+    whole_run[(size_t)phase].add(ns);
+    window[(size_t)phase].add(ns);
+  }
+
+  uint64_t total_ns(Phase phase) const {
+    return whole_run[(size_t)phase].total_ns;
+  }
+
+  // Also count hardware events per phase from now on. counters must outlive
+  // the timers' use.
+  void attach(const PerfCounters &counters) { this->counters = &counters; }
+  const PerfCounters *attached() const { return counters; }
+
+  void record_counts(Phase phase, const CounterValues &before,
+                     const CounterValues &after) {
+    for (size_t c = 0; c < before.size(); c++)
+      counts[(size_t)phase][c] += after[c] - before[c];
+  }
+
+  // Mean time of the phases since the last summary, longest first, and
+  // starts a new window. Phases under 1% of the total are left out.
+  std::string summary() {
+    std::array<size_t, (size_t)Phase::count> order;
+    double total = 0;
+    for (size_t p = 0; p < order.size(); p++) {
+      order[p] = p;
+      total += window[p].mean_ns();
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return window[a].mean_ns() > window[b].mean_ns();
+    });
+    std::string text = "update " + format_duration(total);
+    for (size_t p : order) {
+      if (window[p].count > 0 && window[p].mean_ns() >= total / 100)
+        text += std::format(" {} {}", phase_names[p],
+                            format_duration(window[p].mean_ns()));
+    }
+    window = {};
+    return text;
+  }
+
+  // A table of every phase over the whole run.
+  std::string report() const {
+    double total = 0;
+    for (const PhaseHistogram &histogram : whole_run)
+      total += histogram.total_ns;
+    std::string text = std::format("{:<10}{:>8}{:>10}{:>10}{:>10}{:>10}{:>8}\n",
+                                   "phase", "count", "mean", "p50", "p99",
+                                   "max", "share");
+    for (size_t p = 0; p < whole_run.size(); p++) {
+      const PhaseHistogram &histogram = whole_run[p];
+      if (histogram.count == 0)
+        continue;
+      text += std::format(
+          "{:<10}{:>8}{:>10}{:>10}{:>10}{:>10}{:>7.1f}%\n", phase_names[p],
+          histogram.count, format_duration(histogram.mean_ns()),
+          format_duration(histogram.percentile_ns(50)),
+          format_duration(histogram.percentile_ns(99)),
+          format_duration(histogram.highest_ns),
+          total > 0 ? histogram.total_ns / total * 100 : 0);
+    }
+    return text;
+  }
+
+  // Hardware events of every phase over the whole run: instructions per
+  // cycle and cache misses per update. With interactions, the pair
+  // interactions of one force phase, also misses per interaction and the
+  // flop rate of the force phase against the peak of the cores it ran on.
+  std::string counter_report(double interactions) const {
+    if (!counters || !counters->available())
+      return "";
+    std::string text = std::format("{:<10}{:>10}{:>8}{:>14}{:>14}\n", "phase",
+                                   "Mcycles", "IPC", "L1d miss/upd",
+                                   "LLC miss/upd");
+    for (size_t p = 0; p < counts.size(); p++) {
+      const CounterValues &count = counts[p];
+      const double updates = (double)whole_run[p].count;
+      if (updates == 0)
+        continue;
+      const auto per_update = [&](Counter counter) {
+        return counters->has(counter)
+                   ? std::format("{:.4g}", count[(size_t)counter] / updates)
+                   : std::string("-");
+      };
+      const double cycles = (double)count[(size_t)Counter::cycles];
+      const bool ipc = counters->has(Counter::instructions) && cycles > 0;
+      text += std::format(
+          "{:<10}{:>10}{:>8}{:>14}{:>14}\n", phase_names[p],
+          counters->has(Counter::cycles)
+              ? std::format("{:.4g}", cycles / updates / 1e6)
+              : "-",
+          ipc ? std::format("{:.2f}",
+                            count[(size_t)Counter::instructions] / cycles)
+              : "-",
+          per_update(Counter::l1d_misses), per_update(Counter::llc_misses));
+    }
+
+    const size_t force = (size_t)Phase::force;
+    const double updates = (double)whole_run[force].count;
+    const double cycles = (double)counts[force][(size_t)Counter::cycles];
+    if (interactions > 0 && updates > 0) {
+      const double total = interactions * updates;
+      const double flops = total * flops_per_interaction;
+      text += std::format("force: {:.3g} GFLOP/s",
+                          flops / whole_run[force].total_ns);
+      for (Counter counter : {Counter::l1d_misses, Counter::llc_misses})
+        if (counters->has(counter))
+          text += std::format(", {:.3g} {} per interaction",
+                              counts[force][(size_t)counter] / total,
+                              counter_names[(size_t)counter]);
+      if (counters->has(Counter::cycles) && cycles > 0)
+        text += std::format(", {:.2f} flops per core cycle, {:.1f}% of the "
+                            "{:.0f} peak",
+                            flops / cycles,
+                            flops / cycles / peak_flops_per_cycle * 100,
+                            peak_flops_per_cycle);
+      text += "\n";
+    }
+    return text;
+  }
+
+private:
+  const PerfCounters *counters = nullptr;
+  std::array<CounterValues, (size_t)Phase::count> counts{};
+  std::array<PhaseHistogram, (size_t)Phase::count> whole_run{};
+  std::array<PhaseHistogram, (size_t)Phase::count> window{};
+};
+
+// Times its scope as phase, and adds it to the trace when tracing is on.
+// steady_clock is read through the vDSO on Linux, a few tens of nanoseconds
+// per timer, against phases of microseconds and up. With counters attached
+// they are read before and after too, a read() per counter each time.
+class ScopedTimer {
+public:
+#if defined(NBODY_NO_TIMERS)
+  ScopedTimer(PhaseTimers &, Phase) {}
+#else
+  ScopedTimer(PhaseTimers &timers, Phase phase)
+      : timers(timers), phase(phase) {
+    if (timers.attached())
+      start_counts = timers.attached()->read();
+    start_ns = trace_clock();
+  }
+
+  ~ScopedTimer() {
+    const uint64_t end_ns = trace_clock();
+    if (timers.attached())
+      timers.record_counts(phase, start_counts, timers.attached()->read());
+    timers.record(phase, end_ns - start_ns);
+    if (tracer().enabled())
+      tracer().record(phase_names[(size_t)phase], start_ns, end_ns);
+  }
+
+private:
+  PhaseTimers &timers;
+  Phase phase;
+  uint64_t start_ns;
+  CounterValues start_counts;
+#endif
+
+public:
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+inline constexpr bool timers_enabled =
+#if defined(NBODY_NO_TIMERS)
+    false;
+#else
+    true;
+#endif
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A timeline of the update loop for chrome://tracing or ui.perfetto.dev.
+// Every thread records complete events (name, begin, end and a count of items)
+// into a ring buffer of its own with plain stores, no locks or shared cache
+// lines, and the rings are written out as Chrome trace JSON when asked. Only
+// the last trace_ring_size events of every thread are kept.
+//
+// parallel_for starts new threads every call, so a thread hands its ring back
+// when it exits and the next thread carries on in it. The rings, shown as
+// threads in the trace, end up as the workers of parallel_for plus every
+// background thread.
+
+inline constexpr size_t trace_ring_size = 1 << 16; // a power of 2
+
+inline uint64_t trace_clock() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// One ring, written only by the thread that holds it. A seqlock in two
+// counters lets a writer of the trace read it while it is written:
+// started is bumped before an event is written and written after, so events
+// that may have been overwritten during the read can be told apart.
+struct TraceRing {
+  struct Event {
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> begin_ns, end_ns, items;
+  };
+
+  explicit TraceRing(uint64_t lane) : lane(lane), events(trace_ring_size) {}
+
+  void record(const char *name, uint64_t begin_ns, uint64_t end_ns,
+              uint64_t items) {
+    const uint64_t index = written.load(std::memory_order_relaxed);
+    started.store(index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Event &event = events[index & (trace_ring_size - 1)];
+    event.name.store(name, std::memory_order_relaxed);
+    event.begin_ns.store(begin_ns, std::memory_order_relaxed);
+    event.end_ns.store(end_ns, std::memory_order_relaxed);
+    event.items.store(items, std::memory_order_relaxed);
+    written.store(index + 1, std::memory_order_release);
+  }
+
+  const uint64_t lane;
+  const char *thread_name = nullptr; // set by the first thread to name it
+  std::vector<Event> events;
+  std::atomic<uint64_t> started = 0, written = 0;
+};
+
+class Tracer {
+public:
+  // Start recording. Called once, from the update loop's thread.
+  void start() {
+    epoch_ns = trace_clock();
+    on.store(true, std::memory_order_relaxed);
+    name_thread("update loop");
+  }
+
+  bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+  void record(const char *name, uint64_t begin_ns, uint64_t end_ns,
+              uint64_t items = 0) {
+    ring().record(name, begin_ns, end_ns, items);
+  }
+
+  // Name the calling thread in the trace, if its ring has no name yet.
+  void name_thread(const char *name) {
+    if (!enabled())
+      return;
+    TraceRing &own = ring();
+    std::lock_guard lock(mutex);
+    if (!own.thread_name)
+      own.thread_name = name;
+  }
+
+  // Write every ring as Chrome trace JSON. Threads can keep recording
+  // meanwhile. Throws std::runtime_error.
+  void write(const std::string &path) {
+    std::string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    const auto add = [&](const std::string &event) {
+      json += first ? "" : ",\n";
+      json += event;
+      first = false;
+    };
+
+    std::lock_guard lock(mutex);
+    for (const std::unique_ptr<TraceRing> &ring : rings) {
+      add(std::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                      "\"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}",
+                      ring->lane,
+                      ring->thread_name ? ring->thread_name : "worker"));
+      add(std::format("{{\"name\": \"thread_sort_index\", \"ph\": \"M\", "
+                      "\"pid\": 1, \"tid\": {}, \"args\": {{\"sort_index\": "
+                      "{}}}}}",
+                      ring->lane, ring->lane));
+
+      const uint64_t end = ring->written.load(std::memory_order_acquire);
+      const uint64_t begin = end > trace_ring_size ? end - trace_ring_size : 0;
+      struct Copy {
+        const char *name;
+        uint64_t begin_ns, end_ns, items;
+      };
+      std::vector<Copy> copies;
+      copies.reserve(end - begin);
+      for (uint64_t i = begin; i < end; i++) {
+        const TraceRing::Event &event =
+            ring->events[i & (trace_ring_size - 1)];
+        copies.push_back({event.name.load(std::memory_order_relaxed),
+                          event.begin_ns.load(std::memory_order_relaxed),
+                          event.end_ns.load(std::memory_order_relaxed),
+                          event.items.load(std::memory_order_relaxed)});
+      }
+      // events the thread may have started overwriting while they were read
+      std::atomic_thread_fence(std::memory_order_acquire);
+      const uint64_t started = ring->started.load(std::memory_order_relaxed);
+      const uint64_t valid =
+          started > trace_ring_size ? started - trace_ring_size : 0;
+
+      for (uint64_t i = std::max(begin, valid); i < end; i++) {
+        const Copy &event = copies[i - begin];
+        // events from before start() are left out
+        if (event.begin_ns < epoch_ns)
+          continue;
+        std::string text = std::format(
+            "{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, "
+            "\"ts\": {:.3f}, \"dur\": {:.3f}",
+            event.name, ring->lane, (event.begin_ns - epoch_ns) / 1e3,
+            (event.end_ns - event.begin_ns) / 1e3);
+        if (event.items > 0)
+          text += std::format(", \"args\": {{\"items\": {}}}", event.items);
+        add(text + "}");
+      }
+    }
+    json += "\n]}\n";
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("can't write trace " + path);
+    const bool ok = std::fwrite(json.data(), 1, json.size(), file) ==
+                    json.size();
+    if (std::fclose(file) != 0 || !ok)
+      throw std::runtime_error("can't write trace " + path);
+  }
+
+private:
+  // Hands a thread's ring back when the thread exits.
+  struct Holder {
+    TraceRing *ring = nullptr;
+    Tracer *tracer = nullptr;
+    ~Holder() {
+      if (ring) {
+        std::lock_guard lock(tracer->mutex);
+        tracer->free_rings.push_back(ring);
+      }
+    }
+  };
+
+  TraceRing &ring() {
+    thread_local Holder holder;
+    if (!holder.ring) {
+      std::lock_guard lock(mutex);
+      if (!free_rings.empty()) {
+        // the lowest free lane, so workers keep to the same rows
+        auto lowest = std::min_element(
+            free_rings.begin(), free_rings.end(),
+            [](TraceRing *a, TraceRing *b) { return a->lane < b->lane; });
+        holder.ring = *lowest;
+        free_rings.erase(lowest);
+      } else {
+        rings.push_back(std::make_unique<TraceRing>(rings.size()));
+        holder.ring = rings.back().get();
+      }
+      holder.tracer = this;
+    }
+    return *holder.ring;
+  }
+
+  std::atomic<bool> on = false;
+  uint64_t epoch_ns = 0;
+  std::mutex mutex; // guards rings, free_rings and thread names
+  std::vector<std::unique_ptr<TraceRing>> rings;
+  std::vector<TraceRing *> free_rings;
+};
+
+inline Tracer &tracer() {
+  static Tracer instance;
+  return instance;
+}
+
+// Records its scope as an event when tracing is on. Costs a relaxed load when
+// it's off, and nothing at all when built with NBODY_NO_TIMERS.
+class TraceScope {
+public:
+#if defined(NBODY_NO_TIMERS)
+  explicit TraceScope(const char *, uint64_t = 0) {}
+#else
+  explicit TraceScope(const char *name, uint64_t items = 0)
+      : name(tracer().enabled() ? name : nullptr), items(items),
+        begin_ns(this->name ? trace_clock() : 0) {}
+
+  ~TraceScope() {
+    if (name)
+      tracer().record(name, begin_ns, trace_clock(), items);
+  }
+
+private:
+  const char *name;
+  uint64_t items;
+  uint64_t begin_ns;
+#endif
+
+public:
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+};
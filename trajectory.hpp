@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "body.hpp"
+#include "checkpoint.hpp"
+#include "compression.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+
+// A trajectory file holds the position and velocity of every body for many
+// steps:
+//
+//   TrajectoryHeader
+//   mass column, number_of_bodies doubles (mass doesn't change)
+//   chunks, each a TrajectoryChunkHeader and 6 compressed columns
+//   index, one TrajectoryIndexEntry per chunk
+//   TrajectoryFooter
+//
+// A chunk column is step_count rows of number_of_bodies doubles for one of
+// x, y, z, vx, vy, vz. Each row is XORed with the row before (xor_delta) and
+// the bytes are shuffled before compressing. The index at the end finds the
+// chunk of any step without reading the others. A file whose run was killed
+// has no index but its chunks can still be walked from the front.
+struct TrajectoryHeader {
+  static constexpr std::array<char, 8> expected_magic = {'N', 'B', 'O', 'D',
+                                                         'Y', 'T', 'R', 'J'};
+  static constexpr uint32_t current_version = 1;
+
+  std::array<char, 8> magic = expected_magic;
+  uint32_t version = current_version;
+  uint32_t endian = CheckpointHeader::native_endian;
+  uint64_t number_of_bodies = 0;
+  uint32_t steps_per_chunk = 0;
+  uint32_t step_stride = 1; // updates between stored steps
+  double gravitational_constant = 0;
+  double time_step = 0;
+};
+
+enum TrajectoryFilter : uint32_t {
+  trajectory_xor_delta = 1,
+  trajectory_shuffle = 2,
+};
+
+struct TrajectoryChunkHeader {
+  static constexpr size_t columns = 6;
+
+  uint64_t first_step = 0;
+  uint32_t step_count = 0;
+  uint32_t codec = 0;
+  uint32_t filters = 0;
+  uint32_t reserved = 0;
+  std::array<uint64_t, columns> compressed_sizes{};
+};
+
+struct TrajectoryIndexEntry {
+  uint64_t first_step;
+  uint64_t step_count;
+  uint64_t offset; // of the chunk header from the start of the file
+};
+
+struct TrajectoryFooter {
+  static constexpr std::array<char, 8> expected_magic = {'N', 'B', 'O', 'D',
+                                                         'Y', 'I', 'D', 'X'};
+  uint64_t index_offset = 0;
+  uint64_t chunk_count = 0;
+  std::array<char, 8> magic = expected_magic;
+};
+
+// Appends steps to a trajectory file. append() only copies the positions and
+// velocities into the chunk being filled, full chunks are filtered,
+// compressed (columns in parallel) and written by a background thread. It
+// only waits when two chunks are already queued, trajectories can't drop
+// steps.
+class TrajectoryWriter {
+public:
+  TrajectoryWriter(const std::string &path, const Bodies &bodies,
+                   const SimulationState &state, Codec codec,
+                   uint steps_per_chunk, uint step_stride = 1)
+      : codec(codec), number_of_bodies(bodies.size()), writer(1) {
+    if (!codec_available(codec))
+      throw std::runtime_error(std::string("this build has no ") +
+                               codec_name(codec) + " support");
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("can't write trajectory " + path);
+    // big stdio buffer so every fwrite isn't a system call
+    std::setvbuf(file, nullptr, _IOFBF, 8 << 20);
+
+    header.number_of_bodies = number_of_bodies;
+    header.steps_per_chunk = std::max(1u, steps_per_chunk);
+    header.step_stride = std::max(1u, step_stride);
+    header.gravitational_constant = state.gravitational_constant;
+    header.time_step = state.time_step;
+    write(&header, sizeof(header));
+    write(bodies.mass.data(), number_of_bodies * sizeof(double));
+  }
+
+  ~TrajectoryWriter() { close(); }
+
+  TrajectoryWriter(const TrajectoryWriter &) = delete;
+  TrajectoryWriter &operator=(const TrajectoryWriter &) = delete;
+
+  // Add the bodies as the next step.
+  void append(const Bodies &bodies, uint64_t step) {
+    if (bodies.size() != number_of_bodies)
+      throw std::invalid_argument("number of bodies changed");
+    if (!chunk) {
+      // Two chunks in flight at most, wait for the older one if needed.
+      writer.wait(1);
+      chunk = std::make_shared<Chunk>();
+      chunk->header.first_step = step;
+      for (auto &column : chunk->columns)
+        column.resize((size_t)header.steps_per_chunk * number_of_bodies);
+    }
+
+    const std::array<const Column *, TrajectoryChunkHeader::columns> columns = {
+        &bodies.x, &bodies.y, &bodies.z, &bodies.vx, &bodies.vy, &bodies.vz};
+    const size_t row = (size_t)chunk->header.step_count * number_of_bodies;
+    for (size_t c = 0; c < columns.size(); c++)
+      std::memcpy(chunk->columns[c].data() + row, columns[c]->data(),
+                  number_of_bodies * sizeof(double));
+    chunk->header.step_count++;
+
+    if (chunk->header.step_count == header.steps_per_chunk)
+      flush_chunk();
+  }
+
+  // Write the last chunk, the index and the footer. Nothing can be appended
+  // after. The destructor does it if it wasn't done before.
+  void close() {
+    if (!file)
+      return;
+    flush_chunk();
+    writer.wait();
+
+    // Index and footer so readers can jump to any step.
+    TrajectoryFooter footer;
+    footer.index_offset = offset;
+    footer.chunk_count = index.size();
+    write(index.data(), index.size() * sizeof(TrajectoryIndexEntry));
+    write(&footer, sizeof(footer));
+    if (std::fclose(file) != 0)
+      write_failed = true;
+    file = nullptr;
+  }
+
+  bool failed() const { return write_failed || failed_chunks > 0; }
+  // Chunks that couldn't be compressed or written.
+  uint64_t failures() const { return failed_chunks; }
+
+private:
+  struct Chunk {
+    TrajectoryChunkHeader header;
+    std::array<TrackedVector<uint64_t, Subsystem::io>,
+               TrajectoryChunkHeader::columns>
+        columns;
+  };
+
+  bool write(const void *data, size_t size) {
+    offset += size;
+    if (std::fwrite(data, 1, size, file) == size)
+      return true;
+    write_failed = true;
+    return false;
+  }
+
+  void flush_chunk() {
+    if (!chunk || chunk->header.step_count == 0)
+      return;
+    std::shared_ptr<Chunk> full = std::move(chunk);
+    chunk.reset();
+    writer.submit([this, full] { encode_and_write(*full); });
+  }
+
+  // Runs on the writer thread, chunks are written in the order they filled.
+  // A chunk that can't be compressed, e.g. too big for LZ4 or out of memory,
+  // is left out and counted, and the steps after it are still written.
+  void encode_and_write(Chunk &chunk) {
+    const size_t rows = chunk.header.step_count;
+    const size_t count = rows * number_of_bodies;
+    std::array<std::vector<uint8_t>, TrajectoryChunkHeader::columns> encoded;
+
+    try {
+      parallel_for(
+          encoded.size(),
+          [&](size_t begin, size_t end, unsigned) {
+            std::vector<uint8_t> shuffled(count * sizeof(uint64_t));
+            for (size_t c = begin; c < end; c++) {
+              uint64_t *values = chunk.columns[c].data();
+              xor_delta(values, rows, number_of_bodies);
+              shuffle_bytes((const uint8_t *)values, shuffled.data(), count);
+              compress(codec, shuffled.data(), shuffled.size(), encoded[c]);
+            }
+          },
+          1);
+    } catch (const std::exception &) {
+      failed_chunks++;
+      return;
+    }
+
+    chunk.header.codec = (uint32_t)codec;
+    chunk.header.filters = trajectory_xor_delta | trajectory_shuffle;
+    for (size_t c = 0; c < encoded.size(); c++)
+      chunk.header.compressed_sizes[c] = encoded[c].size();
+
+    index.push_back({chunk.header.first_step, rows, offset});
+    bool written = write(&chunk.header, sizeof(chunk.header));
+    for (const std::vector<uint8_t> &column : encoded)
+      written = write(column.data(), column.size()) && written;
+    if (!written)
+      failed_chunks++;
+  }
+
+  Codec codec;
+  size_t number_of_bodies;
+  TrajectoryHeader header;
+  std::FILE *file = nullptr;
+  uint64_t offset = 0; // only touched by the writer thread after construction
+  std::vector<TrajectoryIndexEntry> index;
+  std::shared_ptr<Chunk> chunk; // being filled by append
+  std::atomic<bool> write_failed = false;
+  std::atomic<uint64_t> failed_chunks = 0;
+  ThreadPool writer; // last so queued chunks are written before the rest goes
+};
+
+// Reads any step of a trajectory file through a memory mapping. Keeps the
+// last decoded chunk so reading steps in order decodes every chunk once.
+class TrajectoryReader {
+public:
+  explicit TrajectoryReader(const std::string &path)
+      : file(std::make_shared<MappedFile>(path)) {
+    if (file->size() < sizeof(header))
+      throw std::runtime_error(path + " is too small to be a trajectory");
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (header.magic != TrajectoryHeader::expected_magic)
+      throw std::runtime_error(path + " is not a trajectory");
+    if (header.endian != CheckpointHeader::native_endian)
+      throw std::runtime_error(path + " was written with another byte order");
+    if (header.version != TrajectoryHeader::current_version)
+      throw std::runtime_error(path + " is an unsupported trajectory version");
+
+    const size_t mass_offset = sizeof(header);
+    const size_t chunks_offset =
+        mass_offset + header.number_of_bodies * sizeof(double);
+    if (chunks_offset > file->size())
+      throw std::runtime_error(path + " is truncated");
+    mass.assign((const double *)(file->data() + mass_offset),
+                (const double *)(file->data() + chunks_offset));
+
+    // Use the index if the run finished, else walk the chunks.
+    TrajectoryFooter footer;
+    if (file->size() >= chunks_offset + sizeof(footer)) {
+      std::memcpy(&footer, file->data() + file->size() - sizeof(footer),
+                  sizeof(footer));
+    }
+    if (footer.magic == TrajectoryFooter::expected_magic &&
+        footer.index_offset +
+                footer.chunk_count * sizeof(TrajectoryIndexEntry) <=
+            file->size()) {
+      index.resize(footer.chunk_count);
+      std::memcpy(index.data(), file->data() + footer.index_offset,
+                  index.size() * sizeof(TrajectoryIndexEntry));
+    } else {
+      for (size_t offset = chunks_offset;
+           offset + sizeof(TrajectoryChunkHeader) <= file->size();) {
+        TrajectoryChunkHeader chunk;
+        std::memcpy(&chunk, file->data() + offset, sizeof(chunk));
+        size_t end = offset + sizeof(chunk);
+        for (uint64_t size : chunk.compressed_sizes)
+          end += size;
+        if (chunk.step_count == 0 || end > file->size())
+          break; // cut off mid chunk
+        index.push_back({chunk.first_step, chunk.step_count, offset});
+        offset = end;
+      }
+    }
+
+    // Chunks that couldn't be written leave gaps between the steps, so
+    // stored steps are counted per chunk rather than worked out from the
+    // step numbers.
+    stored_before.reserve(index.size());
+    uint64_t stored = 0;
+    for (const TrajectoryIndexEntry &entry : index) {
+      stored_before.push_back(stored);
+      stored += entry.step_count;
+    }
+  }
+
+  size_t number_of_bodies() const { return header.number_of_bodies; }
+  uint step_stride() const { return header.step_stride; }
+  const TrajectoryHeader &file_header() const { return header; }
+  const std::vector<TrajectoryIndexEntry> &chunks() const { return index; }
+  const MappedFile &mapped_file() const { return *file; }
+
+  // Number of stored steps.
+  uint64_t steps() const {
+    return index.empty() ? 0 : stored_before.back() + index.back().step_count;
+  }
+
+  // Step number of the n-th stored step.
+  uint64_t step_number(uint64_t n) const {
+    if (index.empty())
+      return n * header.step_stride;
+    const size_t chunk = chunk_of(n);
+    return index[chunk].first_step +
+           (n - stored_before[chunk]) * header.step_stride;
+  }
+
+  // Index of the chunk holding the n-th stored step. Throws
+  // std::out_of_range past the last one.
+  size_t chunk_of(uint64_t n) const {
+    if (n >= steps())
+      throw std::out_of_range("step is not in the trajectory");
+    // the last chunk whose first stored step is at or before n
+    auto first = std::upper_bound(stored_before.begin(), stored_before.end(),
+                                  n);
+    return first - stored_before.begin() - 1;
+  }
+
+  // Start reading the chunks after the one holding the n-th stored step from
+  // disk in the background, so playing on doesn't wait for the disk.
+  void prefetch(uint64_t n, size_t chunks_ahead) const {
+    if (n >= steps())
+      return;
+    const size_t first = chunk_of(n) + 1;
+    const size_t last = std::min(index.size(), first + chunks_ahead);
+    if (first >= last)
+      return;
+    // chunks are back to back, don't touch their headers here, that would
+    // wait for the disk
+    const size_t end = last < index.size() ? index[last].offset : file->size();
+    file->advise(index[first].offset, end - index[first].offset,
+                 MappedFile::Advice::will_need);
+  }
+
+  // Fill bodies with the n-th stored step.
+  void read(uint64_t n, Bodies &bodies) {
+    const size_t chunk = chunk_of(n);
+    const uint64_t row = n - stored_before[chunk];
+
+    decode_chunk(chunk);
+
+    const size_t n_bodies = header.number_of_bodies;
+    bodies.resize(n_bodies);
+    bodies.mass.assign(mass.begin(), mass.end());
+    const std::array<Column *, TrajectoryChunkHeader::columns> columns = {
+        &bodies.x, &bodies.y, &bodies.z, &bodies.vx, &bodies.vy, &bodies.vz};
+    for (size_t c = 0; c < columns.size(); c++)
+      std::memcpy(columns[c]->data(), decoded[c].data() + row * n_bodies,
+                  n_bodies * sizeof(double));
+  }
+
+private:
+  void decode_chunk(size_t chunk_index) {
+    if (decoded_chunk == chunk_index)
+      return;
+    const TrajectoryIndexEntry &entry = index[chunk_index];
+    TrajectoryChunkHeader chunk;
+    std::memcpy(&chunk, file->data() + entry.offset, sizeof(chunk));
+
+    const size_t rows = chunk.step_count;
+    const size_t count = rows * header.number_of_bodies;
+    std::array<size_t, TrajectoryChunkHeader::columns> offsets;
+    offsets[0] = entry.offset + sizeof(chunk);
+    for (size_t c = 1; c < offsets.size(); c++)
+      offsets[c] = offsets[c - 1] + chunk.compressed_sizes[c - 1];
+
+    parallel_for(
+        decoded.size(),
+        [&](size_t begin, size_t end, unsigned) {
+          std::vector<uint8_t> shuffled(count * sizeof(uint64_t));
+          for (size_t c = begin; c < end; c++) {
+            decoded[c].resize(count);
+            uint8_t *output = chunk.filters & trajectory_shuffle
+                                  ? shuffled.data()
+                                  : (uint8_t *)decoded[c].data();
+            decompress((Codec)chunk.codec, file->data() + offsets[c],
+                       chunk.compressed_sizes[c], output,
+                       count * sizeof(uint64_t));
+            if (chunk.filters & trajectory_shuffle)
+              unshuffle_bytes(shuffled.data(), (uint8_t *)decoded[c].data(),
+                              count);
+            if (chunk.filters & trajectory_xor_delta)
+              undo_xor_delta(decoded[c].data(), rows, header.number_of_bodies);
+          }
+        },
+        1);
+    decoded_chunk = chunk_index;
+  }
+
+  std::shared_ptr<MappedFile> file;
+  TrajectoryHeader header;
+  std::vector<double> mass;
+  std::vector<TrajectoryIndexEntry> index;
+  std::vector<uint64_t> stored_before; // stored steps before every chunk
+  std::array<std::vector<uint64_t>, TrajectoryChunkHeader::columns> decoded;
+  size_t decoded_chunk = (size_t)-1;
+};
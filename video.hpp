@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "image.hpp"
+#include "parallel.hpp"
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+enum class VideoFormat {
+  rgb, // headerless rgb24, ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i -
+  y4m  // YUV4MPEG2 4:4:4, ffmpeg -i - reads the size and rate from it
+};
+
+// Streams frames to stdout, a file or a named pipe for an external encoder,
+// without touching disk. Frames are converted into one of two page aligned
+// buffers while a writer thread writes the other in large page sized writes,
+// so the pipe stays full while the next frame is rasterized. The update loop
+// only waits when the encoder is slower than the simulation.
+class VideoStream {
+public:
+  // path "-" means stdout.
+  VideoStream(const std::string &path, VideoFormat format, uint width,
+              uint height, uint frames_per_second)
+      : format(format), width(width), height(height), writer(1) {
+#if defined(_WIN32)
+    if (path == "-") {
+      fd = 1;
+      _setmode(fd, _O_BINARY);
+    } else {
+      fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                 0644);
+    }
+#else
+    // A reader closing the pipe should fail the write, not kill us.
+    std::signal(SIGPIPE, SIG_IGN);
+    fd = path == "-" ? 1 : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#if defined(F_SETPIPE_SZ)
+    // Bigger pipe so a whole frame fits while the encoder catches up. Not
+    // being allowed to is fine.
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#endif
+#endif
+    if (fd < 0)
+      throw std::runtime_error("can't open video output " + path + ": " +
+                               std::strerror(errno));
+
+    // y4m frames start with their own marker so each frame is one write.
+    frame_bytes = (format == VideoFormat::y4m ? frame_marker.size() : 0) +
+                  (size_t)width * height * 3;
+    const size_t buffer_size =
+        (frame_bytes + page_size - 1) / page_size * page_size;
+    for (auto &buffer : buffers)
+      buffer.reset((uint8_t *)::operator new(buffer_size,
+                                             std::align_val_t(page_size)));
+
+    if (format == VideoFormat::y4m) {
+      const std::string header =
+          std::format("YUV4MPEG2 W{} H{} F{}:1 Ip A1:1 C444\n", width, height,
+                      frames_per_second);
+      write_all((const uint8_t *)header.data(), header.size());
+    }
+  }
+
+  ~VideoStream() {
+    writer.wait();
+#if defined(_WIN32)
+    if (fd != 1)
+      _close(fd);
+#else
+    if (fd != 1)
+      close(fd);
+#endif
+  }
+
+  VideoStream(const VideoStream &) = delete;
+  VideoStream &operator=(const VideoStream &) = delete;
+
+  // Queue a frame. Blocks only while both buffers are still being written.
+  void write(const Image &image) {
+    if (image.width != width || image.height != height)
+      throw std::invalid_argument("video frame size changed");
+
+    // The buffer written two frames ago must be done before reusing it.
+    writer.wait(buffers.size() - 1);
+    uint8_t *buffer = buffers[next_buffer].get();
+    next_buffer = (next_buffer + 1) % buffers.size();
+
+    if (format == VideoFormat::rgb) {
+      std::memcpy(buffer, image.pixels.data(), image.pixels.size());
+    } else {
+      std::memcpy(buffer, frame_marker.data(), frame_marker.size());
+      rgb_to_yuv444(image, buffer + frame_marker.size());
+    }
+
+    writer.submit([this, buffer] { write_all(buffer, frame_bytes); });
+  }
+
+  // True once a write failed, e.g. the reader went away.
+  bool failed() const { return write_failed; }
+
+private:
+  static constexpr size_t page_size = 4096;
+  static constexpr std::string_view frame_marker = "FRAME\n";
+
+  struct AlignedDelete {
+    void operator()(uint8_t *buffer) const {
+      ::operator delete(buffer, std::align_val_t(page_size));
+    }
+  };
+
+  // BT.601 full range planar Y, U, V. Pixels are split over threads.
+  static void rgb_to_yuv444(const Image &image, uint8_t *output) {
+    const size_t pixels = (size_t)image.width * image.height;
+    uint8_t *y_plane = output;
+    uint8_t *u_plane = output + pixels;
+    uint8_t *v_plane = output + pixels * 2;
+    parallel_for(pixels, [&](size_t begin, size_t end, unsigned) {
+      for (size_t i = begin; i < end; i++) {
+        const int r = image.pixels[i * 3];
+        const int g = image.pixels[i * 3 + 1];
+        const int b = image.pixels[i * 3 + 2];
+        y_plane[i] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+        u_plane[i] = (uint8_t)std::clamp(
+            ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128, 0, 255);
+        v_plane[i] = (uint8_t)std::clamp(
+            ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128, 0, 255);
+      }
+    });
+  }
+
+  // Write everything in chunks of whole pages, retrying short writes.
+  void write_all(const uint8_t *data, size_t size) {
+    constexpr size_t chunk = 256 * page_size;
+    while (size > 0 && !write_failed) {
+#if defined(_WIN32)
+      const int written = _write(fd, data, (unsigned)std::min(size, chunk));
+#else
+      const ssize_t written = ::write(fd, data, std::min(size, chunk));
+      if (written < 0 && errno == EINTR)
+        continue;
+#endif
+      if (written <= 0) {
+        write_failed = true;
+        return;
+      }
+      data += written;
+      size -= written;
+    }
+  }
+
+  VideoFormat format;
+  uint width, height;
+  int fd = -1;
+  size_t frame_bytes = 0;
+  std::array<std::unique_ptr<uint8_t, AlignedDelete>, 2> buffers;
+  size_t next_buffer = 0;
+  std::atomic<bool> write_failed = false;
+  ThreadPool writer; // last so it finishes queued frames before the buffers go
+};